@@ -0,0 +1,378 @@
+#ifndef BEHAVIOR_HPP
+#define BEHAVIOR_HPP
+
+#include <coroutine>
+#include <vector>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <algorithm>
+
+// Scripted behaviors as C++20 coroutines.
+//
+// A behavior is written as straight line code that suspends with co_await nextFrame() or
+// co_await wait(seconds) and is resumed by a scheduler system. Frames come from a pool so
+// starting one doesn't hit the heap, and a behavior that is waiting costs the scheduler a float
+// compare without touching its frame.
+//
+// Frames are created and destroyed on the thread that owns the scheduler. Resuming may happen
+// on worker threads, see BehaviorWorkers.
+
+// Coroutine frames by size class, 64 bytes apart. Every class keeps a free list threaded
+// through the released blocks and grows by whole slabs.
+class BehaviorFramePool
+{
+public:
+    static constexpr std::size_t classSize = 64;
+    static constexpr std::size_t classCount = 32;
+    static constexpr std::size_t blocksPerSlab = 256;
+
+    BehaviorFramePool() = default;
+    BehaviorFramePool(const BehaviorFramePool&) = delete;
+    BehaviorFramePool& operator=(const BehaviorFramePool&) = delete;
+
+    ~BehaviorFramePool()
+    {
+        for(void* slab : _slabs)
+            ::operator delete(slab);
+    }
+
+    void* allocate(std::size_t size)
+    {
+        const std::size_t c = (size + classSize - 1) / classSize;
+        if(c >= classCount)
+            return ::operator new(size);
+
+        if(!_free[c])
+            grow(c);
+
+        FreeBlock* block = _free[c];
+        _free[c] = block->next;
+        return block;
+    }
+
+    void deallocate(void* p, std::size_t size)
+    {
+        const std::size_t c = (size + classSize - 1) / classSize;
+        if(c >= classCount)
+        {
+            ::operator delete(p);
+            return;
+        }
+
+        FreeBlock* block = static_cast<FreeBlock*>(p);
+        block->next = _free[c];
+        _free[c] = block;
+    }
+
+    // The pool of the calling thread
+    static BehaviorFramePool& local()
+    {
+        thread_local BehaviorFramePool pool;
+        return pool;
+    }
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    void grow(std::size_t c)
+    {
+        const std::size_t blockSize = c * classSize;
+        char* slab = static_cast<char*>(::operator new(blockSize * blocksPerSlab));
+        _slabs.push_back(slab);
+
+        for(std::size_t b = blocksPerSlab; b-- > 0;)
+        {
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + b * blockSize);
+            block->next = _free[c];
+            _free[c] = block;
+        }
+    }
+
+    std::array<FreeBlock*, classCount> _free = {};
+    std::vector<void*> _slabs;
+};
+
+// What a behavior sees of the world, updated by the scheduler before every resume
+struct BehaviorState
+{
+    std::size_t entity;     // Index of the entity, it changes when other entities are removed
+    float ft;               // Seconds since this behavior last ran
+    float time;             // Scheduler time
+    float wakeTime;         // Don't resume before this time
+    float lastRunTime;      // Below zero before the first run
+};
+
+class Behavior
+{
+public:
+    struct promise_type
+    {
+        BehaviorState state = {0, 0.0f, 0.0f, 0.0f, -1.0f};
+
+        Behavior get_return_object()
+        {
+            return Behavior(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        // Start suspended so the scheduler decides when the first step runs
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        // Stay suspended when done so the owner can see that and destroy the frame
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new(std::size_t size)
+        {
+            return BehaviorFramePool::local().allocate(size);
+        }
+
+        static void operator delete(void* p, std::size_t size)
+        {
+            BehaviorFramePool::local().deallocate(p, size);
+        }
+    };
+
+    using Handle = std::coroutine_handle<promise_type>;
+
+    Behavior() = default;
+    explicit Behavior(Handle handle) : _handle(handle) {}
+
+    Behavior(const Behavior&) = delete;
+    Behavior& operator=(const Behavior&) = delete;
+
+    Behavior(Behavior&& other) noexcept : _handle(other._handle)
+    {
+        other._handle = nullptr;
+    }
+
+    Behavior& operator=(Behavior&& other) noexcept
+    {
+        if(this != &other)
+        {
+            reset();
+            _handle = other._handle;
+            other._handle = nullptr;
+        }
+        return *this;
+    }
+
+    ~Behavior()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        if(_handle)
+            _handle.destroy();
+        _handle = nullptr;
+    }
+
+    Handle handle() const
+    {
+        return _handle;
+    }
+
+    bool running() const
+    {
+        return _handle && !_handle.done();
+    }
+
+private:
+    Handle _handle;
+};
+
+// co_await behaviorState() gives the state of the running behavior, keep the reference
+struct BehaviorStateAwaiter
+{
+    BehaviorState* state;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(Behavior::Handle handle) noexcept
+    {
+        state = &handle.promise().state;
+        return false;
+    }
+
+    BehaviorState& await_resume() const noexcept { return *state; }
+};
+
+inline BehaviorStateAwaiter behaviorState()
+{
+    return {};
+}
+
+// Suspend until the scheduler time reaches the wake time
+struct BehaviorWaitAwaiter
+{
+    float seconds;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(Behavior::Handle handle) noexcept
+    {
+        BehaviorState& state = handle.promise().state;
+        state.wakeTime = state.time + seconds;
+    }
+
+    void await_resume() const noexcept {}
+};
+
+inline BehaviorWaitAwaiter nextFrame()
+{
+    return {0.0f};
+}
+
+inline BehaviorWaitAwaiter wait(float seconds)
+{
+    return {seconds};
+}
+
+// Resume one behavior for entity e at the given scheduler time
+inline void resumeBehavior(Behavior::Handle handle, std::size_t e, float time)
+{
+    BehaviorState& state = handle.promise().state;
+    state.entity = e;
+    state.ft = state.lastRunTime < 0.0f ? 0.0f : time - state.lastRunTime;
+    state.time = time;
+    state.lastRunTime = time;
+    handle.resume();
+}
+
+
+// A fixed set of threads that split a range of work with the calling thread, which takes part.
+// With zero threads everything runs on the caller.
+class BehaviorWorkers
+{
+public:
+    // Range of items [begin, end) handed to one call
+    using Task = std::function<void(std::size_t begin, std::size_t end)>;
+
+    static constexpr std::size_t chunkSize = 256;
+
+    BehaviorWorkers() = default;
+    BehaviorWorkers(const BehaviorWorkers&) = delete;
+    BehaviorWorkers& operator=(const BehaviorWorkers&) = delete;
+
+    ~BehaviorWorkers()
+    {
+        stop();
+    }
+
+    void start(std::size_t threadCount)
+    {
+        stop();
+
+        _quit = false;
+        for(std::size_t t = 0; t < threadCount; t++)
+            _threads.emplace_back([this] { workerLoop(); });
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _quit = true;
+        }
+        _wake.notify_all();
+
+        for(auto& thread : _threads)
+            thread.join();
+        _threads.clear();
+    }
+
+    std::size_t threadCount() const
+    {
+        return _threads.size();
+    }
+
+    // Run task over [0, count) in chunks and return when all of them are done
+    void run(std::size_t count, const Task& task)
+    {
+        if(_threads.empty() || count <= chunkSize)
+        {
+            if(count > 0)
+                task(0, count);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _task = &task;
+            _count = count;
+            _next = 0;
+            _busy = _threads.size();
+            _generation++;
+        }
+        _wake.notify_all();
+
+        runChunks(task, count);
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [this] { return _busy == 0; });
+        _task = nullptr;
+    }
+
+private:
+    void runChunks(const Task& task, std::size_t count)
+    {
+        std::size_t begin;
+        while((begin = _next.fetch_add(chunkSize)) < count)
+            task(begin, std::min(begin + chunkSize, count));
+    }
+
+    void workerLoop()
+    {
+        uint64_t seenGeneration = 0;
+
+        while(true)
+        {
+            const Task* task;
+            std::size_t count;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [&] { return _quit || _generation != seenGeneration; });
+                if(_quit)
+                    return;
+
+                seenGeneration = _generation;
+                task = _task;
+                count = _count;
+            }
+
+            runChunks(*task, count);
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            if(--_busy == 0)
+                _done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+
+    const Task* _task = nullptr;
+    std::size_t _count = 0;
+    std::atomic<std::size_t> _next{0};
+    std::size_t _busy = 0;
+    uint64_t _generation = 0;
+    bool _quit = false;
+};
+
+#endif
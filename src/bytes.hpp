@@ -0,0 +1,113 @@
+#ifndef BYTES_HPP
+#define BYTES_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// Byte stream helpers, all multi byte values are little endian
+struct ByteWriter
+{
+    std::vector<uint8_t>& bytes;
+
+    void u8(uint8_t v)
+    {
+        bytes.push_back(v);
+    }
+
+    void u16(uint16_t v)
+    {
+        u8(v & 0xFF);
+        u8(v >> 8);
+    }
+
+    void u32(uint32_t v)
+    {
+        u16(v & 0xFFFF);
+        u16(v >> 16);
+    }
+
+    void f32(float v)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        u32(bits);
+    }
+
+    void varint(uint32_t v)
+    {
+        while(v >= 0x80)
+        {
+            u8((v & 0x7F) | 0x80);
+            v >>= 7;
+        }
+        u8(v);
+    }
+
+    // Signed deltas are zigzag encoded so small negative values stay small
+    void svarint(int32_t v)
+    {
+        varint(((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+    }
+};
+
+struct ByteReader
+{
+    const uint8_t* data;
+    std::size_t size;
+    std::size_t pos;
+    bool failed;
+
+    uint8_t u8()
+    {
+        if(pos >= size)
+        {
+            failed = true;
+            return 0;
+        }
+        return data[pos++];
+    }
+
+    uint16_t u16()
+    {
+        uint16_t lo = u8();
+        return lo | (uint16_t)(u8() << 8);
+    }
+
+    uint32_t u32()
+    {
+        uint32_t lo = u16();
+        return lo | ((uint32_t)u16() << 16);
+    }
+
+    float f32()
+    {
+        uint32_t bits = u32();
+        float v;
+        std::memcpy(&v, &bits, sizeof(v));
+        return v;
+    }
+
+    uint32_t varint()
+    {
+        uint32_t v = 0;
+        for(int shift = 0; shift < 35; shift += 7)
+        {
+            uint8_t b = u8();
+            v |= (uint32_t)(b & 0x7F) << shift;
+            if(!(b & 0x80))
+                return v;
+        }
+        failed = true;
+        return 0;
+    }
+
+    int32_t svarint()
+    {
+        uint32_t v = varint();
+        return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+    }
+};
+
+#endif
@@ -0,0 +1,396 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <algorithm>
+
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Recording of the rendered frames.
+//
+// The render thread only copies a finished frame into one of a few preallocated buffers, a
+// background thread converts and writes it. When the writer falls behind and every buffer is
+// taken the frame is dropped instead of making the render loop wait, so capturing doesn't push
+// the frame time over budget. The target is a .y4m file, raw 4:2:0 video that ffmpeg and most
+// players read, or a path prefix for a numbered PNG sequence.
+
+// PNG without a compression library, the image goes into stored deflate blocks
+namespace png
+{
+    struct CrcTable
+    {
+        uint32_t values[256];
+
+        constexpr CrcTable() : values()
+        {
+            for(uint32_t n = 0; n < 256; n++)
+            {
+                uint32_t c = n;
+                for(int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                values[n] = c;
+            }
+        }
+    };
+
+    inline uint32_t crc32(uint32_t crc, const uint8_t* data, std::size_t size)
+    {
+        static constexpr CrcTable table;
+
+        crc = ~crc;
+        for(std::size_t i = 0; i < size; i++)
+            crc = table.values[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    inline uint32_t adler32(const uint8_t* data, std::size_t size)
+    {
+        uint32_t a = 1, b = 0;
+        while(size > 0)
+        {
+            // The most bytes before b can overflow between two reductions
+            const std::size_t n = std::min<std::size_t>(size, 5552);
+            for(std::size_t i = 0; i < n; i++)
+            {
+                a += data[i];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+            data += n;
+            size -= n;
+        }
+        return b << 16 | a;
+    }
+
+    inline void putU32(std::vector<uint8_t>& out, uint32_t v)
+    {
+        out.push_back(v >> 24);
+        out.push_back(v >> 16);
+        out.push_back(v >> 8);
+        out.push_back(v);
+    }
+
+    // A chunk is its length, type, data and the CRC of type and data. Returns where the length goes.
+    inline std::size_t beginChunk(std::vector<uint8_t>& out, const char* type)
+    {
+        const std::size_t at = out.size();
+        putU32(out, 0);
+        out.insert(out.end(), type, type + 4);
+        return at;
+    }
+
+    inline void endChunk(std::vector<uint8_t>& out, std::size_t at)
+    {
+        const uint32_t size = out.size() - at - 8;
+        for(int i = 0; i < 4; i++)
+            out[at + i] = size >> (24 - 8 * i);
+        putU32(out, crc32(0, out.data() + at + 4, size + 4));
+    }
+
+    // RGBA pixels to a whole RGB PNG file in out, raw is scratch for the filtered rows
+    inline void encodeRgba(const uint8_t* rgba, int width, int height, std::vector<uint8_t>& out, std::vector<uint8_t>& raw)
+    {
+        constexpr std::size_t maxStored = 65535;
+        const std::size_t rowSize = 1 + (std::size_t)width * 3;    // Filter type 0 and the pixels
+
+        raw.resize(rowSize * height);
+        for(int y = 0; y < height; y++)
+        {
+            uint8_t* row = raw.data() + y * rowSize;
+            const uint8_t* pixels = rgba + (std::size_t)y * width * 4;
+            row[0] = 0;
+            for(int x = 0; x < width; x++)
+            {
+                row[1 + x * 3] = pixels[x * 4];
+                row[2 + x * 3] = pixels[x * 4 + 1];
+                row[3 + x * 3] = pixels[x * 4 + 2];
+            }
+        }
+
+        static constexpr uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        out.assign(signature, signature + 8);
+        out.reserve(8 + 25 + 12 + 2 + raw.size() + (raw.size() / maxStored + 1) * 5 + 4 + 12);
+
+        std::size_t chunk = beginChunk(out, "IHDR");
+        putU32(out, width);
+        putU32(out, height);
+        out.insert(out.end(), {8, 2, 0, 0, 0});     // 8 bit RGB, no interlacing
+        endChunk(out, chunk);
+
+        // zlib stream of stored deflate blocks
+        chunk = beginChunk(out, "IDAT");
+        out.push_back(0x78);
+        out.push_back(0x01);
+        for(std::size_t at = 0; at < raw.size(); at += maxStored)
+        {
+            const std::size_t size = std::min(maxStored, raw.size() - at);
+            out.push_back(at + size == raw.size());
+            out.insert(out.end(), {(uint8_t)size, (uint8_t)(size >> 8), (uint8_t)~size, (uint8_t)(~size >> 8)});
+            out.insert(out.end(), raw.begin() + at, raw.begin() + at + size);
+        }
+        putU32(out, adler32(raw.data(), raw.size()));
+        endChunk(out, chunk);
+
+        chunk = beginChunk(out, "IEND");
+        endChunk(out, chunk);
+    }
+}
+
+// BT.601 coefficients at full range (0-255, as in JFIF), 4:2:0 with chroma from the average of
+// every 2x2 block. out gets the Y, U and V planes one after the other.
+inline void rgbaToYuv420(const uint8_t* rgba, int width, int height, std::vector<uint8_t>& out)
+{
+    const int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+    out.resize((std::size_t)width * height + 2 * (std::size_t)chromaWidth * chromaHeight);
+
+    uint8_t* luma = out.data();
+    uint8_t* cb = luma + (std::size_t)width * height;
+    uint8_t* cr = cb + (std::size_t)chromaWidth * chromaHeight;
+
+    // 16.16 fixed point weights
+    for(std::size_t i = 0; i < (std::size_t)width * height; i++)
+    {
+        const uint8_t* p = rgba + i * 4;
+        luma[i] = (19595 * p[0] + 38470 * p[1] + 7471 * p[2] + 32768) >> 16;
+    }
+
+    for(int cy = 0; cy < chromaHeight; cy++)
+    {
+        for(int cx = 0; cx < chromaWidth; cx++)
+        {
+            int r = 0, g = 0, b = 0, n = 0;
+            for(int y = cy * 2; y < std::min(cy * 2 + 2, height); y++)
+            {
+                for(int x = cx * 2; x < std::min(cx * 2 + 2, width); x++)
+                {
+                    const uint8_t* p = rgba + ((std::size_t)y * width + x) * 4;
+                    r += p[0];
+                    g += p[1];
+                    b += p[2];
+                    n++;
+                }
+            }
+
+            // Both can round up to 256 for saturated colors
+            const int i = cy * chromaWidth + cx;
+            cb[i] = std::min(255, (128 * 65536 * n - 11058 * r - 21710 * g + 32768 * b + 32768 * n) / (65536 * n));
+            cr[i] = std::min(255, (128 * 65536 * n + 32768 * r - 27439 * g - 5329 * b + 32768 * n) / (65536 * n));
+        }
+    }
+}
+
+
+class FrameCapture
+{
+public:
+    FrameCapture() = default;
+    FrameCapture(const FrameCapture&) = delete;
+    FrameCapture& operator=(const FrameCapture&) = delete;
+
+    ~FrameCapture()
+    {
+        close();
+    }
+
+    // target is a .y4m file or a prefix that "000123.png" is appended to. One frame out of every
+    // is kept, ringSize frames can wait for the writer before frames get dropped.
+    bool open(const std::string& target, int width, int height, int fps, int every = 1, std::size_t ringSize = 4)
+    {
+        close();
+
+        _width = width;
+        _height = height;
+        _every = every > 0 ? every : 1;
+        _frame = 0;
+        _written = 0;
+        _dropped = 0;
+        _head = 0;
+        _tail = 0;
+        _quit = false;
+        _failed = false;
+
+        _y4m = target.size() > 4 && target.compare(target.size() - 4, 4, ".y4m") == 0;
+        if(_y4m)
+        {
+            _file = std::fopen(target.c_str(), "wb");
+            if(!_file)
+                return false;
+
+            // The frame rate is a fraction, so keeping every Nth frame still plays at the right speed.
+            // C420jpeg only sets the chroma siting, the range has to be given on its own or readers
+            // assume limited range.
+            std::fprintf(_file, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg XCOLORRANGE=FULL\n", width, height, fps, _every);
+        }
+        _prefix = target;
+
+        _slots.resize(ringSize > 0 ? ringSize : 1);
+        for(auto& slot : _slots)
+            slot.pixels.assign((std::size_t)width * height * 4, 0);
+
+        _writer = std::thread([this] { writerLoop(); });
+        _open = true;
+        return true;
+    }
+
+    // Finishes writing the frames that were taken
+    void close()
+    {
+        if(!_open)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _quit = true;
+        }
+        _wake.notify_one();
+        _writer.join();
+
+        if(_file)
+            std::fclose(_file);
+        _file = nullptr;
+        _slots.clear();
+        _open = false;
+    }
+
+    bool isOpen() const
+    {
+        return _open;
+    }
+
+    // Call with the finished frame, right before it is shown. readPixels(pixels, pitch) copies
+    // width * height RGBA pixels and returns false when it can't.
+    template<typename ReadFunc>
+    void capture(ReadFunc&& readPixels)
+    {
+        if(!_open || _frame++ % _every != 0)
+            return;
+
+        // Only this thread moves the head, the writer moves the tail once a slot is written
+        const uint64_t head = _head.load(std::memory_order_relaxed);
+        if(head - _tail.load(std::memory_order_acquire) >= _slots.size())
+        {
+            _dropped++;
+            return;
+        }
+
+        Slot& slot = _slots[head % _slots.size()];
+        if(!readPixels(slot.pixels.data(), _width * 4))
+        {
+            _dropped++;
+            return;
+        }
+        slot.frame = _frame - 1;
+
+        _head.store(head + 1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+        }
+        _wake.notify_one();
+    }
+
+    std::size_t written() const
+    {
+        return _written;
+    }
+
+    std::size_t dropped() const
+    {
+        return _dropped;
+    }
+
+private:
+    struct Slot
+    {
+        std::vector<uint8_t> pixels;
+        uint64_t frame;
+    };
+
+    void writerLoop()
+    {
+#if defined(__linux__)
+        // Background work, on a busy machine the render thread should win the core
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+#endif
+
+        std::vector<uint8_t> encoded;
+        std::vector<uint8_t> scratch;   // PNG rows
+
+        while(true)
+        {
+            const uint64_t tail = _tail.load(std::memory_order_relaxed);
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [&] { return _quit || _head.load(std::memory_order_acquire) != tail; });
+                if(_head.load(std::memory_order_acquire) == tail)
+                    return;
+            }
+
+            const Slot& slot = _slots[tail % _slots.size()];
+            if(!_failed && !writeFrame(slot, encoded, scratch))
+            {
+                std::cerr << "Could not write captured frame " << slot.frame << ", capture stopped" << std::endl;
+                _failed = true;
+            }
+            _written += !_failed;
+
+            _tail.store(tail + 1, std::memory_order_release);
+        }
+    }
+
+    bool writeFrame(const Slot& slot, std::vector<uint8_t>& encoded, std::vector<uint8_t>& scratch)
+    {
+        if(_y4m)
+        {
+            rgbaToYuv420(slot.pixels.data(), _width, _height, encoded);
+            return std::fputs("FRAME\n", _file) >= 0 && std::fwrite(encoded.data(), 1, encoded.size(), _file) == encoded.size();
+        }
+
+        png::encodeRgba(slot.pixels.data(), _width, _height, encoded, scratch);
+
+        char number[32];
+        std::snprintf(number, sizeof(number), "%06llu.png", (unsigned long long)slot.frame);
+        std::FILE* file = std::fopen((_prefix + number).c_str(), "wb");
+        if(!file)
+            return false;
+
+        const bool written = std::fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+        return std::fclose(file) == 0 && written;
+    }
+
+    std::vector<Slot> _slots;
+    std::atomic<uint64_t> _head{0};     // Next slot the render thread fills
+    std::atomic<uint64_t> _tail{0};     // Next slot the writer writes
+
+    std::thread _writer;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _quit = false;
+    bool _open = false;
+    bool _failed = false;               // Writer only
+
+    int _width = 0, _height = 0;
+    int _every = 1;
+    uint64_t _frame = 0;
+    std::atomic<std::size_t> _written{0};
+    std::size_t _dropped = 0;
+
+    bool _y4m = false;
+    std::FILE* _file = nullptr;
+    std::string _prefix;
+};
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef COLLISION_HPP
+#define COLLISION_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <cmath>
+
+// Broad phase: a uniform grid of boxes rebuilt every frame with a counting sort. Only the cells
+// that will be queried are filled, so a few queries in a big field stay cheap.
+// Narrow phase: a swept segment against a closed polyline.
+
+struct CollisionBox
+{
+    float minX, minY, maxX, maxY;
+};
+
+struct CollisionSegment
+{
+    float x0, y0, x1, y1;
+};
+
+inline CollisionBox boxOfSegment(const CollisionSegment& seg)
+{
+    return {std::min(seg.x0, seg.x1), std::min(seg.y0, seg.y1), std::max(seg.x0, seg.x1), std::max(seg.y0, seg.y1)};
+}
+
+struct CollisionGrid
+{
+    float cellSize;
+    int columns, rows;
+
+    std::vector<CollisionBox> boxes;
+    std::vector<uint32_t> cellStart;    // columns * rows + 1 offsets into cellItems
+    std::vector<uint32_t> cellItems;    // Box indices, grouped by cell
+    std::vector<uint32_t> cellCursor;
+
+    // Cells something will be queried in, one bit per column for every row. Boxes that don't
+    // touch an active cell can be left out. activeSpans[y0 * rows + y1] is the union of rows
+    // y0 to y1 so that test doesn't need a loop.
+    std::vector<uint64_t> activeRows;
+    std::vector<uint64_t> activeSpans;
+
+    // Per box stamp so a box that covers several cells is only returned once per query
+    std::vector<uint32_t> lastQuery;
+    uint32_t queryId;
+};
+
+// At most 64 columns so a row of active cells fits one mask, cellSize grows to fit
+void initCollisionGrid(CollisionGrid& grid, float width, float height, float cellSize)
+{
+    grid.cellSize = std::max(cellSize, width / 64.0f);
+    grid.columns = std::max(1, (int)std::ceil(width / grid.cellSize));
+    grid.rows = std::max(1, (int)std::ceil(height / grid.cellSize));
+    grid.cellStart.assign(grid.columns * grid.rows + 1, 0);
+    grid.activeRows.assign(grid.rows, 0);
+    grid.activeSpans.assign(grid.rows * grid.rows, 0);
+    grid.boxes.clear();
+    grid.queryId = 0;
+}
+
+// Cell range covered by a box, clamped to the grid. Truncation only differs from floor below
+// zero, where the clamp makes them agree again.
+inline void collisionCellRange(const CollisionGrid& grid, const CollisionBox& box, int& x0, int& y0, int& x1, int& y1)
+{
+    const float inv = 1.0f / grid.cellSize;
+    const float maxX = grid.columns - 1, maxY = grid.rows - 1;
+    x0 = (int)std::min(std::max(box.minX * inv, 0.0f), maxX);
+    y0 = (int)std::min(std::max(box.minY * inv, 0.0f), maxY);
+    x1 = (int)std::min(std::max(box.maxX * inv, 0.0f), maxX);
+    y1 = (int)std::min(std::max(box.maxY * inv, 0.0f), maxY);
+}
+
+// Bits x0 to x1 of a row mask
+inline uint64_t collisionColumnMask(int x0, int x1)
+{
+    return (~0ull >> (63 - x1)) & (~0ull << x0);
+}
+
+void clearActiveCells(CollisionGrid& grid)
+{
+    std::fill(grid.activeRows.begin(), grid.activeRows.end(), 0);
+}
+
+void activateCells(CollisionGrid& grid, const CollisionBox& box)
+{
+    int x0, y0, x1, y1;
+    collisionCellRange(grid, box, x0, y0, x1, y1);
+    for(int y = y0; y <= y1; y++)
+        grid.activeRows[y] |= collisionColumnMask(x0, x1);
+}
+
+// Call after the last activateCells and before overlapsActiveCell
+void finishActiveCells(CollisionGrid& grid)
+{
+    for(int y0 = 0; y0 < grid.rows; y0++)
+    {
+        uint64_t span = 0;
+        for(int y1 = y0; y1 < grid.rows; y1++)
+        {
+            span |= grid.activeRows[y1];
+            grid.activeSpans[y0 * grid.rows + y1] = span;
+        }
+    }
+}
+
+inline bool overlapsActiveCell(const CollisionGrid& grid, const CollisionBox& box)
+{
+    int x0, y0, x1, y1;
+    collisionCellRange(grid, box, x0, y0, x1, y1);
+    return (grid.activeSpans[y0 * grid.rows + y1] & collisionColumnMask(x0, x1)) != 0;
+}
+
+// Sort grid.boxes into the active cells they overlap, linear in the number of box/cell overlaps.
+// Cells that aren't active stay empty.
+void buildCollisionGrid(CollisionGrid& grid)
+{
+    const std::size_t cellCount = grid.columns * grid.rows;
+    std::fill(grid.cellStart.begin(), grid.cellStart.end(), 0);
+
+    int x0, y0, x1, y1;
+    for(auto& box : grid.boxes)
+    {
+        collisionCellRange(grid, box, x0, y0, x1, y1);
+        for(int y = y0; y <= y1; y++)
+        {
+            uint64_t columns = grid.activeRows[y] & collisionColumnMask(x0, x1);
+            for(; columns != 0; columns &= columns - 1)
+                grid.cellStart[y * grid.columns + __builtin_ctzll(columns) + 1]++;
+        }
+    }
+
+    for(std::size_t c = 0; c < cellCount; c++)
+        grid.cellStart[c + 1] += grid.cellStart[c];
+
+    grid.cellItems.resize(grid.cellStart[cellCount]);
+    grid.cellCursor.assign(grid.cellStart.begin(), grid.cellStart.end() - 1);
+
+    for(uint32_t b = 0; b < grid.boxes.size(); b++)
+    {
+        collisionCellRange(grid, grid.boxes[b], x0, y0, x1, y1);
+        for(int y = y0; y <= y1; y++)
+        {
+            uint64_t columns = grid.activeRows[y] & collisionColumnMask(x0, x1);
+            for(; columns != 0; columns &= columns - 1)
+                grid.cellItems[grid.cellCursor[y * grid.columns + __builtin_ctzll(columns)]++] = b;
+        }
+    }
+
+    grid.lastQuery.assign(grid.boxes.size(), 0);
+}
+
+// Call visit(index) for every box overlapping box, each at most once. The query stops early
+// when visit returns false.
+template<typename VisitFunc>
+void queryCollisionGrid(CollisionGrid& grid, const CollisionBox& box, VisitFunc&& visit)
+{
+    if(++grid.queryId == 0)
+    {
+        std::fill(grid.lastQuery.begin(), grid.lastQuery.end(), 0);
+        grid.queryId = 1;
+    }
+
+    int x0, y0, x1, y1;
+    collisionCellRange(grid, box, x0, y0, x1, y1);
+
+    for(int y = y0; y <= y1; y++)
+    {
+        for(int x = x0; x <= x1; x++)
+        {
+            const int cell = y * grid.columns + x;
+            for(uint32_t i = grid.cellStart[cell]; i < grid.cellStart[cell + 1]; i++)
+            {
+                const uint32_t b = grid.cellItems[i];
+                const CollisionBox& other = grid.boxes[b];
+
+                if(grid.lastQuery[b] == grid.queryId ||
+                        other.maxX < box.minX || other.minX > box.maxX ||
+                        other.maxY < box.minY || other.minY > box.maxY)
+                    continue;
+
+                grid.lastQuery[b] = grid.queryId;
+                if(!visit(b))
+                    return;
+            }
+        }
+    }
+}
+
+// True when the segment (x0, y0) -> (x1, y1) touches the circle at (cx, cy) before time maxT
+inline bool sweepCircleEntry(float x0, float y0, float x1, float y1, float cx, float cy, float radius, float maxT)
+{
+    const float dx = x1 - x0, dy = y1 - y0;
+    const float px = x0 - cx, py = y0 - cy;
+
+    const float c = px * px + py * py - radius * radius;
+    if(c <= 0.0f)
+        return true;
+
+    // Solve |p + t * d| = radius for the first t
+    const float a = dx * dx + dy * dy;
+    const float b = px * dx + py * dy;
+    const float discriminant = b * b - a * c;
+    if(a == 0.0f || b >= 0.0f || discriminant < 0.0f)
+        return false;
+
+    const float t = (-b - std::sqrt(discriminant)) / a;
+    return t <= 1.0f && t < maxT;
+}
+
+// Time of first contact in [0, 1] of the segment (x0, y0) -> (x1, y1) with the closed polyline in
+// vertices[fromI, toI), or a value above 1 when they don't touch. A segment that lies completely
+// inside the polygon hits at t = 0.
+//
+// The edge loop has no data dependent branches so it vectorizes.
+float sweepSegmentPolygon(float x0, float y0, float x1, float y1, const float* vertices, std::size_t fromI, std::size_t toI)
+{
+    const float dx = x1 - x0;
+    const float dy = y1 - y0;
+
+    float first = 2.0f;
+    int crossings = 0;
+
+    for(std::size_t i = fromI; i + 3 < toI; i += 2)
+    {
+        const float ax = vertices[i], ay = vertices[i+1];
+        const float ex = vertices[i+2] - ax, ey = vertices[i+3] - ay;
+        const float px = ax - x0, py = ay - y0;
+
+        // Segment/edge intersection with parameters t along the segment and u along the edge
+        const float denom = dx * ey - dy * ex;
+        const float t = (px * ey - py * ex) / denom;
+        const float u = (px * dy - py * dx) / denom;
+        const bool hit = denom != 0.0f && t >= 0.0f && t <= 1.0f && u >= 0.0f && u <= 1.0f;
+        first = hit ? std::min(first, t) : first;
+
+        // Crossing number of the end point for the inside test
+        const float by = vertices[i+3];
+        const bool straddles = (ay > y1) != (by > y1);
+        const float crossX = ax + (y1 - ay) / (by - ay) * ex;
+        crossings += straddles && x1 < crossX;
+    }
+
+    if(first > 1.0f && (crossings & 1))
+        return 0.0f;
+
+    return first;
+}
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef INPUT_HPP
+#define INPUT_HPP
+
+#include <SDL2/SDL.h>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+#include <algorithm>
+
+// Keyboard input with timestamps.
+//
+// Instead of sleeping until the next frame and then polling, the frame wait takes events as
+// they arrive and stamps each one. The systems then get the key changes of the frame with the
+// time they happened at, so a shot or a thrust can start part way through the step instead of
+// at its start.
+
+// Key state, true while a key is held
+using KeyMap = std::unordered_map<unsigned int, bool>;
+
+bool isKeyDown(const KeyMap& keymap, unsigned int key)
+{
+    auto itt = keymap.find(key);
+    if(itt == keymap.end())
+        return false;
+    return itt->second;
+}
+
+using InputClock = std::chrono::steady_clock;
+
+struct InputEvent
+{
+    float time;     // Seconds into the frame step, between 0 and its frame time
+    unsigned int key;
+    bool down;
+};
+
+// The input of one frame step
+struct FrameInput
+{
+    KeyMap keys;                        // State at the end of the step
+    std::vector<InputEvent> events;     // Key changes during the step, in order
+};
+
+// Collects events between frames
+struct InputCollector
+{
+    struct Pending
+    {
+        InputClock::time_point time;
+        unsigned int key;
+        bool down;
+    };
+
+    std::vector<Pending> pending;
+    KeyMap keys;
+    bool quit = false;
+};
+
+void handleInputEvent(InputCollector& input, const SDL_Event& e, InputClock::time_point time)
+{
+    switch(e.type)
+    {
+        case SDL_QUIT:
+            input.quit = true;
+            break;
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+        {
+            // Key repeat and duplicates don't change anything
+            const bool down = e.type == SDL_KEYDOWN;
+            const unsigned int key = e.key.keysym.sym;
+            if(isKeyDown(input.keys, key) == down)
+                break;
+
+            input.keys[key] = down;
+            input.pending.push_back({time, key, down});
+            break;
+        }
+    }
+}
+
+// Take the events that are already queued
+void pollInput(InputCollector& input)
+{
+    SDL_Event e;
+    while(SDL_PollEvent(&e))
+        handleInputEvent(input, e, InputClock::now());
+}
+
+// Block for the given time while taking events as they arrive. SDL waits in whole
+// milliseconds, the rest is slept so the frame time stays as exact as a plain sleep.
+template<typename Duration>
+void waitForInput(InputCollector& input, Duration duration)
+{
+    using namespace std::chrono;
+
+    const auto end = InputClock::now() + duration;
+
+    SDL_Event e;
+    while(true)
+    {
+        const int timeoutMs = duration_cast<milliseconds>(end - InputClock::now()).count();
+        if(timeoutMs <= 0)
+            break;
+
+        if(SDL_WaitEventTimeout(&e, timeoutMs))
+            handleInputEvent(input, e, InputClock::now());
+    }
+
+    pollInput(input);
+    std::this_thread::sleep_until(end);
+}
+
+// Hand the collected events to a step of frameTime seconds that ends now. Events older than the
+// step are clamped to its start.
+void takeFrameInput(InputCollector& input, FrameInput& frame, float frameTime)
+{
+    const auto now = InputClock::now();
+
+    frame.keys = input.keys;
+    frame.events.clear();
+    for(auto& event : input.pending)
+    {
+        const float age = std::chrono::duration<float>(now - event.time).count();
+        frame.events.push_back({std::max(frameTime - age, 0.0f), event.key, event.down});
+    }
+    input.pending.clear();
+}
+
+// For input that only has a state per step, like network acks: a change counts as happening at
+// the start of the step
+void setFrameKey(FrameInput& input, unsigned int key, bool down)
+{
+    if(down == isKeyDown(input.keys, key))
+        return;
+
+    input.keys[key] = down;
+    input.events.push_back({0.0f, key, down});
+}
+
+// Whether key was down at the start of the step
+bool wasKeyDown(const FrameInput& input, unsigned int key)
+{
+    for(auto& event : input.events)
+        if(event.key == key)
+            return !event.down;
+    return isKeyDown(input.keys, key);
+}
+
+bool hasKeyEvents(const FrameInput& input, unsigned int key)
+{
+    for(auto& event : input.events)
+        if(event.key == key)
+            return true;
+    return false;
+}
+
+// Seconds key was held during a step of frameTime seconds
+float keyHeldTime(const FrameInput& input, unsigned int key, float frameTime)
+{
+    bool down = wasKeyDown(input, key);
+    float since = 0.0f;
+    float held = 0.0f;
+
+    for(auto& event : input.events)
+    {
+        if(event.key != key)
+            continue;
+
+        if(down && !event.down)
+            held += event.time - since;
+        since = event.time;
+        down = event.down;
+    }
+
+    if(down)
+        held += frameTime - since;
+
+    return held;
+}
+
+#endif
@@ -10,31 +10,40 @@
 #include <random>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <barrier>
 #include <unordered_map>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
 
 
 
 #include "renderer.hpp"
+#include "fastmath.hpp"
+#include "particles.hpp"
+#include "net.hpp"
+#include "snapshot.hpp"
+#include "scene.hpp"
+#include "text.hpp"
+#include "collision.hpp"
+#include "metrics.hpp"
+#include "behavior.hpp"
+#include "input.hpp"
+#include "random.hpp"
+#include "capture.hpp"
+#include "raster.hpp"
+#include "parse.hpp"
 
 // Window Constants
 constexpr int windowWidth = 640;
 constexpr int windowHeight = 480;
 
 
-// Define the keymap and related function
-using KeyMap = std::unordered_map<unsigned int, bool>;
-
-bool isKeyDown(const KeyMap& keymap, unsigned int key)
-{
-    auto itt = keymap.find(key);
-    if(itt == keymap.end())
-        return false;
-    return itt->second;
-}
-
-
-template<typename resolution, int targetFps>
-int limitFps()
+// Sleeps with waitFor(duration), which can do useful work like taking input as long as it
+// returns after that time
+template<typename resolution, int targetFps, typename WaitFunc>
+int limitFps(WaitFunc&& waitFor)
 {
     using ClockType = std::conditional<
         std::chrono::high_resolution_clock::is_steady,
@@ -56,7 +65,7 @@ int limitFps()
 
     // Sleep the process if needed
     if(workTime < targetFrameTime)
-        std::this_thread::sleep_for(resolution(targetFrameTime - workTime));
+        waitFor(resolution(targetFrameTime - workTime));
 
     // Sample second time point
     endTime = ClockType::now();
@@ -69,13 +78,20 @@ int limitFps()
     return ticks;
 }
 
+template<typename resolution, int targetFps>
+int limitFps()
+{
+    return limitFps<resolution, targetFps>([](resolution duration) { std::this_thread::sleep_for(duration); });
+}
+
 enum class ShapeDef
 {
     NONE = 0,
     SHIP = 1,
     FLAME = 2,
     FIRST_ASTROID = 3,
-    LAST_ASTROID = 7
+    LAST_ASTROID = 7,
+    SAUCER = 8
         // TODO (FYLL MED ALLA SHAPE SAKER...
 };
 
@@ -87,70 +103,34 @@ static const std::vector<std::vector<float>> shapeDefs = {
     {1,4, 3,3, 1,1, 4,-1, 2,-4, -2,-4, -4,-1, -4,2, -1,3, 1,4},
     {-2,0,-4,-1,-1,-4,2,-4,4,-1,4,1,2,4,0,4,0,1,-2,4,-4,1,-2,0},
     {-1,-2,-2,-4,1,-4,4,-2,4,-1,1,0,4,2,2,4,1,3,-2,4,-4,1,-4,-2,-1,-2},
-    {-4,-2,-2,-4,2,-4,4,-2,4,2,2,4,-2,4,-4,2,-4,-2}
+    {-4,-2,-2,-4,2,-4,4,-2,4,2,2,4,-2,4,-4,2,-4,-2},
+    {-6,0, -3,2, 3,2, 6,0, -6,0, -3,-2, -1,-4, 1,-4, 3,-2, 6,0} // SAUCER
 };
-//
-//        LETTERS: [
-//		[0,6,0,2,2,0,4,2,4,4,0,4,4,4,4,6],                 //A
-//		[0,3,0,6,2,6,3,5,3,4,2,3,0,3,0,0,2,0,3,1,3,2,2,3], //B
-//		[4,0,0,0,0,6,4,6],                                 //C
-//		[0,0,0,6,2,6,4,4,4,2,2,0,0,0],                     //D
-//		[4,0,0,0,0,3,3,3,0,3,0,6,4,6],                     //E
-//		[4,0,0,0,0,3,3,3,0,3,0,6],                         //F
-//		[4,2,4,0,0,0,0,6,4,6,4,4,2,4],                     //G
-//		[0,0,0,6,0,3,4,3,4,0,4,6],                         //H
-//		[0,0,4,0,2,0,2,6,4,6,0,6],                         //I
-//		[4,0,4,6,2,6,0,4],                                 //J
-//		[3,0,0,3,0,0,0,6,0,3,3,6],                         //K
-//		[0,0,0,6,4,6],                                     //L
-//		[0,6,0,0,2,2,4,0,4,6],                             //M
-//		[0,6,0,0,4,6,4,0],                                 //N
-//		[0,0,4,0,4,6,0,6,0,0],                             //O
-//		[0,6,0,0,4,0,4,3,0,3],                             //P
-//		[0,0,0,6,2,6,3,5,4,6,2,4,3,5,4,4,4,0,0,0],         //Q
-//		[0,6,0,0,4,0,4,3,0,3,1,3,4,6],                     //R
-//		[4,0,0,0,0,3,4,3,4,6,0,6],                         //S
-//		[0,0,4,0,2,0,2,6],                                 //T
-//		[0,0,0,6,4,6,4,0],                                 //U
-//		[0,0,2,6,4,0],                                     //V
-//		[0,0,0,6,2,4,4,6,4,0],                             //W
-//		[0,0,4,6,2,3,4,0,0,6],                             //X
-//		[0,0,2,2,4,0,2,2,2,6],                             //Y
-//		[0,0,4,0,0,6,4,6]                                  //Z
-//	],
-//
-//	NUMBERS: [
-//		[0,0,0,6,4,6,4,0,0,0],                             //0
-//		[2,0,2,6],                                         //1
-//		[0,0,4,0,4,3,0,3,0,6,4,6],                         //2
-//		[0,0,4,0,4,3,0,3,4,3,4,6,0,6],                     //3
-//		[0,0,0,3,4,3,4,0,4,6],                             //4
-//		[4,0,0,0,0,3,4,3,4,6,0,6],                         //5
-//		[0,0,0,6,4,6,4,3,0,3],                             //6
-//		[0,0,4,0,4,6],                                     //7
-//		[0,3,4,3,4,6,0,6,0,0,4,0,4,3],                     //8
-//		[4,3,0,3,0,0,4,0,4,6],                             //9
-//        ]
-//
 
 // Shape drawing pipeline
 
 struct ShapeDrawInfo
 {
     float scaleFact;
-    float dirValue;
+    float dirX, dirY;
     float x, y;
     uint32_t color;
 
     std::size_t fromI, toI;
+
+    // The vertices are already transformed, copied from the previous frame
+    bool cached;
 };
 
 void transformShapes(std::vector<float>& shapeData, const std::vector<ShapeDrawInfo>& drawInfo)
 {
     for(auto& info : drawInfo)
     {
-        float s = std::sin(info.dirValue);
-        float c = std::cos(info.dirValue);
+        if(info.cached)
+            continue;
+
+        float s = info.dirY;
+        float c = info.dirX;
 
         for(int i = info.fromI; i < info.toI; i+=2)
         {
@@ -171,6 +151,33 @@ void transformShapes(std::vector<float>& shapeData, const std::vector<ShapeDrawI
     }
 }
 
+// Append every visible label, already in screen space so transformShapes leaves it alone
+void addTextToShapeData(const TextBatch& batch, std::vector<float>& shapeData, std::vector<ShapeDrawInfo>& drawInfo)
+{
+    for(auto& label : batch.labels)
+    {
+        if(!label.visible)
+            continue;
+
+        const std::size_t base = shapeData.size();
+        const auto& vertices = label.run.vertices;
+
+        shapeData.resize(base + vertices.size());
+        for(std::size_t i = 0; i < vertices.size(); i += 2)
+        {
+            shapeData[base + i] = vertices[i] + label.x;
+            shapeData[base + i + 1] = vertices[i + 1] + label.y;
+        }
+
+        std::size_t fromI = base;
+        for(auto end : label.run.strokeEnds)
+        {
+            drawInfo.push_back({1.0f, 1.0f, 0.0f, 0.0f, 0.0f, label.color, fromI, base + end, true});
+            fromI = base + end;
+        }
+    }
+}
+
 void renderShapes(const std::vector<float>& shapeData, const std::vector<ShapeDrawInfo>& drawInfo)
 {
     for(auto& info : drawInfo)
@@ -186,6 +193,17 @@ void renderShapes(const std::vector<float>& shapeData, const std::vector<ShapeDr
     }
 }
 
+// renderShapes into an offscreen image
+void rasterizeShapes(RasterImage& image, const std::vector<float>& shapeData, const std::vector<ShapeDrawInfo>& drawInfo)
+{
+    for(auto& info : drawInfo)
+    {
+        const std::size_t toI = std::min(info.toI, shapeData.size());
+        for(std::size_t i = info.fromI + 2; i + 1 < toI; i += 2)
+            drawRasterLine(image, shapeData[i-2], shapeData[i-1], shapeData[i], shapeData[i+1], info.color);
+    }
+}
+
 
 
 // Entity things
@@ -205,7 +223,8 @@ using GroupMap = std::unordered_map<ComponentBitset, Group>;
 
 inline std::size_t makeNewComponentId()
 {
-    static std::size_t id = 0;
+    // Worlds stepped on different threads can see a component for the first time at once
+    static std::atomic<std::size_t> id{0};
     return id++;
 }
 
@@ -237,6 +256,9 @@ struct CRotation
 {
     float rotationSpeed;
     float dir;
+
+    // Unit direction of dir (cos, sin), kept up to date by rotateEntites and addCRotation
+    float dirX, dirY;
 };
 
 struct CShape
@@ -276,6 +298,29 @@ struct CControlFire
     bool fired;
 };
 
+// Owns the coroutine frame. wakeTime mirrors the one in the frame so waiting behaviors can be
+// skipped without touching it.
+struct CBehavior
+{
+    Behavior behavior;
+    float wakeTime;
+};
+
+
+// METRICS
+// Counted where they happen, everything else is gathered when the metrics are published
+struct EcsMetrics
+{
+    uint64_t groupHits = 0;             // getEntitesForSystem served from the cache
+    uint64_t groupRebuilds = 0;         // getEntitesForSystem scanned every entity
+    uint64_t groupInvalidations = 0;    // All cached groups thrown away
+    uint64_t reallocations = 0;         // Component vectors grown to a new allocation
+    uint64_t removed = 0;
+    uint64_t removedLastFrame = 0;
+
+    // Seconds per frame as returned by limitFps
+    MetricHistogram frameTimes = makeHistogram({0.005, 0.01, 0.0167, 0.02, 0.033, 0.05, 0.1, 0.25, 1.0});
+};
 
 // ENTITY
 struct EntityManager
@@ -290,15 +335,31 @@ struct EntityManager
     std::vector<CBullet> bulletList;
     std::vector<CLifeTime> lifeTimeList;
     std::vector<CControlFire> canFireList;
+    std::vector<CBehavior> behaviorList;
 
     std::vector<ComponentBitset> componentBitsets;
     std::vector<bool> markedForRemoval;
 
+    // Stable ids that survive the swap and pop in delEntity, used to identify entities over the network
+    std::vector<uint32_t> idList;
+    uint32_t nextId = 0;
+
+    // Change tracking. changeTicks[componentId][e] is the tick of the last write to that component
+    // of e. A column stays empty until the component is first written, after that it has one
+    // entry per entity. changeTick moves forward every time a system queries for changes.
+    std::array<std::vector<uint32_t>, maxComponents> changeTicks;
+    uint32_t changeTick = 1;
+
     GroupMap groupMap;
+
+    EcsMetrics metrics;
 };
 
 Entity addEntity(EntityManager& manager)
 {
+    // Every entity vector grows in step, so one of them tells when all of them reallocated
+    const std::size_t capacity = manager.componentBitsets.capacity();
+
     manager.posList.push_back({});
     manager.velocityList.push_back({});
     manager.scaleList.push_back({});
@@ -309,11 +370,21 @@ Entity addEntity(EntityManager& manager)
     manager.bulletList.push_back({});
     manager.lifeTimeList.push_back({});
     manager.canFireList.push_back({});
+    manager.behaviorList.push_back({});
 
     manager.componentBitsets.push_back({});
     manager.markedForRemoval.push_back(false);
+    manager.idList.push_back(manager.nextId++);
+
+    if(manager.componentBitsets.capacity() != capacity)
+        manager.metrics.reallocations++;
+
+    for(auto& column : manager.changeTicks)
+        if(!column.empty())
+            column.push_back(0);
     
     // For now clear all cached entites. Mayby TODO add entity to the right group when created
+    manager.metrics.groupInvalidations++;
     for(auto& it : manager.groupMap)
     {
         it.second.entities.clear();
@@ -323,6 +394,172 @@ Entity addEntity(EntityManager& manager)
     return manager.componentBitsets.size() - 1;
 };
 
+// Bulk creation of entities that share one archetype
+struct EntityRange
+{
+    Entity first;
+    std::size_t count;
+};
+
+template<typename... Components>
+ComponentBitset makeArchetype()
+{
+    ComponentBitset archetype;
+    (archetype.set(getUniqueComponentId<Components>()), ...);
+    return archetype;
+}
+
+void reserveEntities(EntityManager& manager, std::size_t count)
+{
+    manager.posList.reserve(count);
+    manager.velocityList.reserve(count);
+    manager.scaleList.reserve(count);
+    manager.rotationList.reserve(count);
+    manager.shapeList.reserve(count);
+    manager.moveList.reserve(count);
+    manager.invisibleList.reserve(count);
+    manager.bulletList.reserve(count);
+    manager.lifeTimeList.reserve(count);
+    manager.canFireList.reserve(count);
+    manager.behaviorList.reserve(count);
+
+    manager.componentBitsets.reserve(count);
+    manager.markedForRemoval.reserve(count);
+    manager.idList.reserve(count);
+
+    for(auto& column : manager.changeTicks)
+        if(!column.empty())
+            column.reserve(count);
+}
+
+EntityRange addEntities(EntityManager& manager, std::size_t count, ComponentBitset archetype)
+{
+    const Entity first = manager.componentBitsets.size();
+    const std::size_t newSize = first + count;
+
+    // Grow every vector at most once for the whole batch
+    if(newSize > manager.componentBitsets.capacity())
+    {
+        reserveEntities(manager, std::max(newSize, manager.componentBitsets.capacity() * 2));
+        manager.metrics.reallocations++;
+    }
+
+    manager.posList.resize(newSize);
+    manager.velocityList.resize(newSize);
+    manager.scaleList.resize(newSize);
+    manager.rotationList.resize(newSize);
+    manager.shapeList.resize(newSize);
+    manager.moveList.resize(newSize);
+    manager.invisibleList.resize(newSize);
+    manager.bulletList.resize(newSize);
+    manager.lifeTimeList.resize(newSize);
+    manager.canFireList.resize(newSize);
+    manager.behaviorList.resize(newSize);
+
+    manager.componentBitsets.resize(newSize, archetype);
+    manager.markedForRemoval.resize(newSize, false);
+
+    for(Entity e = first; e < newSize; e++)
+        manager.idList.push_back(manager.nextId++);
+
+    // Every component of the archetype counts as written. Columns follow the capacity of the
+    // entity vectors so they don't reallocate on their own schedule.
+    for(std::size_t id = 0; id < maxComponents; id++)
+    {
+        auto& column = manager.changeTicks[id];
+        if((archetype[id] || !column.empty()) && column.capacity() < manager.componentBitsets.capacity())
+            column.reserve(manager.componentBitsets.capacity());
+
+        if(archetype[id])
+            column.resize(newSize, manager.changeTick);
+        else if(!column.empty())
+            column.resize(newSize, 0);
+    }
+
+    // The archetype is known up front so cached groups can be extended instead of cleared.
+    // New entities come after all existing ones, which keeps the groups sorted.
+    for(auto& it : manager.groupMap)
+    {
+        if(!it.second.set || (archetype & it.first) != it.first)
+            continue;
+
+        auto& entities = it.second.entities;
+        if(entities.size() + count > entities.capacity())
+            entities.reserve(std::max(entities.size() + count, entities.capacity() * 2));
+
+        for(Entity e = first; e < newSize; e++)
+            entities.push_back(e);
+    }
+
+    return {first, count};
+}
+
+// CHANGE TRACKING
+std::vector<uint32_t>& getChangeColumn(EntityManager& manager, std::size_t componentId)
+{
+    auto& column = manager.changeTicks[componentId];
+    if(column.size() != manager.componentBitsets.size())
+        column.resize(manager.componentBitsets.size(), 0);
+    return column;
+}
+
+template<typename T>
+std::vector<uint32_t>& getChangeColumn(EntityManager& manager)
+{
+    return getChangeColumn(manager, getUniqueComponentId<T>());
+}
+
+template<typename T>
+void markChanged(EntityManager& manager, Entity e)
+{
+    getChangeColumn<T>(manager)[e] = manager.changeTick;
+}
+
+// Systems that only care about changes keep one of these between runs
+struct ChangeQuery
+{
+    uint32_t lastRunTick = 0;
+    std::vector<Entity> entities;
+};
+
+// The entities of a group where any component in changedBitset was written since the last run
+// of this query. Keeps the group order.
+const std::vector<Entity>& getChangedEntities(EntityManager& manager, const std::vector<Entity>& entities,
+        ComponentBitset changedBitset, ChangeQuery& query)
+{
+    std::array<const uint32_t*, maxComponents> columns;
+    std::size_t columnCount = 0;
+
+    for(std::size_t id = 0; id < maxComponents; id++)
+        if(changedBitset[id])
+            columns[columnCount++] = getChangeColumn(manager, id).data();
+
+    query.entities.clear();
+
+    for(auto& e : entities)
+    {
+        for(std::size_t c = 0; c < columnCount; c++)
+        {
+            if(columns[c][e] > query.lastRunTick)
+            {
+                query.entities.push_back(e);
+                break;
+            }
+        }
+    }
+
+    // Writes from here on get a newer tick so the next run sees them
+    query.lastRunTick = manager.changeTick++;
+
+    return query.entities;
+}
+
+template<typename T>
+void fillComponents(std::vector<T>& list, EntityRange range, const T& value)
+{
+    std::fill(list.begin() + range.first, list.begin() + range.first + range.count, value);
+}
+
 template<typename T>
 void removeEntityFromVector(std::vector<T>& v, Entity e)
 {
@@ -342,31 +579,44 @@ void delEntity(EntityManager& manager, Entity e)
     removeEntityFromVector(manager.bulletList, e);
     removeEntityFromVector(manager.lifeTimeList, e);
     removeEntityFromVector(manager.canFireList, e);
+    removeEntityFromVector(manager.behaviorList, e);
 
     removeEntityFromVector(manager.componentBitsets, e);
     removeEntityFromVector(manager.markedForRemoval, e);
+    removeEntityFromVector(manager.idList, e);
+
+    for(auto& column : manager.changeTicks)
+        if(!column.empty())
+            removeEntityFromVector(column, e);
 }
 
 void removeEntities(EntityManager& manager)
 {
     bool oneEntityRemoved = false;
+    std::size_t removed = 0;
     for(Entity e = 0; e < manager.markedForRemoval.size(); e++)
     {
         if(manager.markedForRemoval[e])
         {
             oneEntityRemoved = true;
             delEntity(manager, e);
+            removed++;
         }
     }
 
+    manager.metrics.removed += removed;
+    manager.metrics.removedLastFrame = removed;
 
     // Clear all cached data since we cannot know if the data is correct
     if(oneEntityRemoved)
+    {
+        manager.metrics.groupInvalidations++;
         for(auto& it : manager.groupMap)
         {
             it.second.entities.clear();
             it.second.set = false;
         }
+    }
 }
 
 const std::vector<Entity>& getEntitesForSystem(EntityManager& manager, ComponentBitset bitset)
@@ -376,7 +626,12 @@ const std::vector<Entity>& getEntitesForSystem(EntityManager& manager, Component
     if(it != manager.groupMap.end())
     {
         if(it->second.set)
+        {
+            manager.metrics.groupHits++;
             return it->second.entities;
+        }
+
+        manager.metrics.groupRebuilds++;
 
         for(Entity e = 0; e < manager.componentBitsets.size(); e++)
             if((manager.componentBitsets[e] & bitset) == bitset)
@@ -387,6 +642,8 @@ const std::vector<Entity>& getEntitesForSystem(EntityManager& manager, Component
         return it->second.entities;
     }
 
+    manager.metrics.groupRebuilds++;
+
     std::vector<Entity> entites;
     entites.reserve(manager.componentBitsets.size());
 
@@ -403,66 +660,82 @@ void addCPosition(EntityManager& manager, Entity e, const CPosition& pos)
 {
     manager.posList[e] = pos;
     manager.componentBitsets[e][getUniqueComponentId<CPosition>()] = true;
+    markChanged<CPosition>(manager, e);
 }
 
 void addCVelocity(EntityManager& manager, Entity e, const CVelocity& vel)
 {
     manager.velocityList[e] = vel;
     manager.componentBitsets[e][getUniqueComponentId<CVelocity>()] = true;
+    markChanged<CVelocity>(manager, e);
 }
 
 void addCScale(EntityManager& manager, Entity e, const CScale& scale)
 {
     manager.scaleList[e] = scale;
     manager.componentBitsets[e][getUniqueComponentId<CScale>()] = true;
+    markChanged<CScale>(manager, e);
 }
 
 void addCRotation(EntityManager& manager, Entity e, const CRotation& rot)
 {
     manager.rotationList[e] = rot;
+    fastmath::sinCos(rot.dir, manager.rotationList[e].dirY, manager.rotationList[e].dirX);
     manager.componentBitsets[e][getUniqueComponentId<CRotation>()] = true;
+    markChanged<CRotation>(manager, e);
 }
 
 void addCShape(EntityManager& manager, Entity e, const CShape& shape)
 {
     manager.shapeList[e] = shape;
     manager.componentBitsets[e][getUniqueComponentId<CShape>()] = true;
+    markChanged<CShape>(manager, e);
 }
 
 void addCControlMove(EntityManager& manager, Entity e, const CControlMove& controlMove)
 {
     manager.moveList[e] = controlMove;
     manager.componentBitsets[e][getUniqueComponentId<CControlMove>()] = true;
+    markChanged<CControlMove>(manager, e);
 }
 
 void addCInvisible(EntityManager& manager, Entity e, const CControlInvisible& invisible)
 {
     manager.invisibleList[e] = invisible;
     manager.componentBitsets[e][getUniqueComponentId<CControlInvisible>()] = true;
+    markChanged<CControlInvisible>(manager, e);
 }
 
 void addCBullet(EntityManager& manager, Entity e, const CBullet& bullet)
 {
     manager.bulletList[e] = bullet;
     manager.componentBitsets[e][getUniqueComponentId<CBullet>()] = true;
+    markChanged<CBullet>(manager, e);
 }
 
 void addCLifeTime(EntityManager& manager, Entity e, const CLifeTime& lifeTime)
 {
     manager.lifeTimeList[e] = lifeTime;
     manager.componentBitsets[e][getUniqueComponentId<CLifeTime>()] = true;
+    markChanged<CLifeTime>(manager, e);
 }
 
 void addCCanFire(EntityManager& manager, Entity e, const CControlFire& canfire)
 {
     manager.canFireList[e] = canfire;
     manager.componentBitsets[e][getUniqueComponentId<CControlFire>()] = true;
+    markChanged<CControlFire>(manager, e);
 }
 
 // Entity behaviour
-void createAstroid(EntityManager& manager, std::mt19937& randGen, float scale, float xPos = 0.0f, float yPos = 0.0f);
-void createShip(EntityManager& manager);
-void createBullet(EntityManager& manager, float xPos, float yPos, float dir);
+EntityRange createAstroids(EntityManager& manager, CounterRandom& random, std::size_t count, float scale);
+EntityRange createAstroids(EntityManager& manager, CounterRandom& random, std::size_t count, const SpawnDistribution& dist,
+        ComponentBitset extraComponents = {});
+void createShips(EntityManager& manager, std::size_t count);
+void createBullet(EntityManager& manager, float xPos, float yPos, float dirX, float dirY, float age = 0.0f);
+
+// Seconds a bullet lives
+constexpr float bulletLifeTime = 0.5f;
 
 ComponentBitset getSaveLastPosBitset()
 {
@@ -476,11 +749,13 @@ void saveLastPos(const std::vector<Entity>& entities, EntityManager& manager)
 {
     auto& positions = manager.posList;
     auto& bullets = manager.bulletList;
+    auto& bulletChanges = getChangeColumn<CBullet>(manager);
 
     for(auto& e : entities)
     {
         bullets[e].xLast = positions[e].x;
         bullets[e].yLast = positions[e].y;
+        bulletChanges[e] = manager.changeTick;
     }
 }
 
@@ -496,9 +771,15 @@ void moveEntities(const std::vector<Entity>& entities, EntityManager& manager, f
 {
     auto& positions = manager.posList;
     auto& velocities = manager.velocityList;
+    auto& positionChanges = getChangeColumn<CPosition>(manager);
 
     for(auto& e : entities)
     {
+        if(velocities[e].xVel == 0.0f && velocities[e].yVel == 0.0f)
+            continue;
+
+        positionChanges[e] = manager.changeTick;
+
         positions[e].x += velocities[e].xVel * ft;
         positions[e].y += velocities[e].yVel * ft;
 
@@ -524,15 +805,40 @@ ComponentBitset getRotateEntitiesBitset()
 void rotateEntites(const std::vector<Entity>& entities, EntityManager& manager, float ft)
 {
     auto& rotations = manager.rotationList;
+    auto& rotationChanges = getChangeColumn<CRotation>(manager);
 
-    for(auto& e : entities)
+    // Gather the rotating entities in small blocks so the basis can be computed four lanes at a
+    // time. Entities that don't rotate keep their angle and basis.
+    constexpr std::size_t blockSize = 16;
+    Entity rotating[blockSize];
+    float angles[blockSize], sins[blockSize], coss[blockSize];
+
+    std::size_t i = 0;
+    while(i < entities.size())
     {
-        rotations[e].dir += rotations[e].rotationSpeed * ft;
+        std::size_t count = 0;
+        for(; i < entities.size() && count < blockSize; i++)
+        {
+            const Entity e = entities[i];
+            auto& rot = rotations[e];
+            if(rot.rotationSpeed == 0.0f)
+                continue;
+
+            rot.dir = fastmath::wrapAngle(rot.dir + rot.rotationSpeed * ft);
+            rotationChanges[e] = manager.changeTick;
+            rotating[count] = e;
+            angles[count] = rot.dir;
+            count++;
+        }
+
+        fastmath::sinCos(angles, sins, coss, count);
 
-        while(rotations[e].dir > M_PI)
-            rotations[e].dir -= 2.0f * M_PI;
-        while(rotations[e].dir < -M_PI)
-            rotations[e].dir += 2.0f * M_PI;
+        for(std::size_t j = 0; j < count; j++)
+        {
+            auto& rot = rotations[rotating[j]];
+            rot.dirX = coss[j];
+            rot.dirY = sins[j];
+        }
     }
 }
 
@@ -546,30 +852,45 @@ ComponentBitset getControllMoveEntitiesBitset()
     return controllerBitset;
 }
 
-void controllEnities(const std::vector<Entity>& entities, EntityManager& manager, const KeyMap& keymap, float ft)
+// Thrust is applied for the part of the step the key was actually held
+void controllEnities(const std::vector<Entity>& entities, EntityManager& manager, const FrameInput& input, float ft)
 {
     auto& positions = manager.posList;
     auto& velocities = manager.velocityList;
     auto& rotations = manager.rotationList;
     auto& controlMoves = manager.moveList;
+    auto& velocityChanges = getChangeColumn<CVelocity>(manager);
+    auto& rotationChanges = getChangeColumn<CRotation>(manager);
+
+    const float thrustTime = keyHeldTime(input, SDLK_UP, ft);
 
     for(auto& e : entities)
     {
-        rotations[e].rotationSpeed = 0.0f;
+        float rotationSpeed = 0.0f;
+
+        if(isKeyDown(input.keys, SDLK_LEFT))
+            rotationSpeed -= controlMoves[e].rotationSpeed;
+        else if(isKeyDown(input.keys, SDLK_RIGHT))
+            rotationSpeed += controlMoves[e].rotationSpeed;
 
-        if(isKeyDown(keymap, SDLK_LEFT))
-            rotations[e].rotationSpeed -= controlMoves[e].rotationSpeed;
-        else if(isKeyDown(keymap, SDLK_RIGHT))
-            rotations[e].rotationSpeed += controlMoves[e].rotationSpeed;
+        if(rotations[e].rotationSpeed != rotationSpeed)
+        {
+            rotations[e].rotationSpeed = rotationSpeed;
+            rotationChanges[e] = manager.changeTick;
+        }
 
-        if(isKeyDown(keymap, SDLK_UP))
+        if(thrustTime > 0.0f)
         {
-            velocities[e].xVel += std::cos(rotations[e].dir) * ft * controlMoves[e].accelFactor;
-            velocities[e].yVel += std::sin(rotations[e].dir) * ft * controlMoves[e].accelFactor;
+            velocities[e].xVel += rotations[e].dirX * thrustTime * controlMoves[e].accelFactor;
+            velocities[e].yVel += rotations[e].dirY * thrustTime * controlMoves[e].accelFactor;
         }
 
+        if(velocities[e].xVel == 0.0f && velocities[e].yVel == 0.0f)
+            continue;
+
         velocities[e].xVel *= 0.99f;
         velocities[e].yVel *= 0.99f;
+        velocityChanges[e] = manager.changeTick;
     }
 }
 
@@ -594,11 +915,15 @@ void showInvisibleEntities(const std::vector<Entity>& entities, EntityManager& m
         {
             invisibles[e].isVisible = true;
             std::swap(invisibles[e].invisibleShape, shapes[e].shape);
+            markChanged<CControlInvisible>(manager, e);
+            markChanged<CShape>(manager, e);
         }
         else if(!isKeyDown(keymap, SDLK_UP) && invisibles[e].isVisible)
         {
             invisibles[e].isVisible = false;
             std::swap(invisibles[e].invisibleShape, shapes[e].shape);
+            markChanged<CControlInvisible>(manager, e);
+            markChanged<CShape>(manager, e);
         }
     }
 }
@@ -614,10 +939,12 @@ void lifeTimeEntities(const std::vector<Entity>& entities, EntityManager& manage
 {
     auto& lifeTimes = manager.lifeTimeList;
     auto& markedForRemoval = manager.markedForRemoval;
+    auto& lifeTimeChanges = getChangeColumn<CLifeTime>(manager);
 
     for(auto& e : entities)
     {
         lifeTimes[e].time -= ft;
+        lifeTimeChanges[e] = manager.changeTick;
 
         if(lifeTimes[e].time < 0.0f)
             markedForRemoval[e] = true;
@@ -634,7 +961,9 @@ ComponentBitset getFireingEntitiesBitset()
     return canFireBitset;
 }
 
-void fireingEntities(const std::vector<Entity>& entities, EntityManager& manager, const KeyMap& keymap)
+// Every press during the step fires, and the bullet starts out as far along as it would be had
+// it been fired at the moment of the press
+void fireingEntities(const std::vector<Entity>& entities, EntityManager& manager, const FrameInput& input, float ft)
 {
     auto& canFires = manager.canFireList;
     auto& positions = manager.posList;
@@ -643,15 +972,200 @@ void fireingEntities(const std::vector<Entity>& entities, EntityManager& manager
 
     for(auto& e : entities)
     {
-        if(isKeyDown(keymap, SDLK_SPACE) && !canFires[e].fired)
+        auto fire = [&](float time)
+        {
+            float startX = positions[e].x + rotations[e].dirX * scales[e].scale * 6.0f;
+            float startY = positions[e].y + rotations[e].dirY * scales[e].scale * 6.0f;
+            createBullet(manager, startX, startY, rotations[e].dirX, rotations[e].dirY, ft - time);
+        };
+
+        bool fired = canFires[e].fired;
+        for(auto& event : input.events)
+        {
+            if(event.key != SDLK_SPACE)
+                continue;
+
+            if(event.down && !fired)
+                fire(event.time);
+            fired = event.down;
+        }
+
+        // An entity that appears while the key is held fires right away
+        if(isKeyDown(input.keys, SDLK_SPACE) && !fired)
+        {
+            fire(ft);
+            fired = true;
+        }
+
+        if(fired != canFires[e].fired)
         {
-            canFires[e].fired = true;
-            float startX = positions[e].x + std::cos(rotations[e].dir) * scales[e].scale * 6.0f;
-            float startY = positions[e].y + std::sin(rotations[e].dir) * scales[e].scale * 6.0f;
-            createBullet(manager, startX, startY, rotations[e].dir);
+            canFires[e].fired = fired;
+            markChanged<CControlFire>(manager, e);
         }
-        else if(!isKeyDown(keymap, SDLK_SPACE) && canFires[e].fired)
-            canFires[e].fired = false;
+    }
+}
+
+ComponentBitset getEmitExhaustBitset()
+{
+    ComponentBitset emitExhaustBitset;
+    emitExhaustBitset[getUniqueComponentId<CControlInvisible>()] = true;
+    emitExhaustBitset[getUniqueComponentId<CPosition>()] = true;
+    emitExhaustBitset[getUniqueComponentId<CRotation>()] = true;
+    emitExhaustBitset[getUniqueComponentId<CScale>()] = true;
+    return emitExhaustBitset;
+}
+
+void emitExhaust(const std::vector<Entity>& entities, EntityManager& manager, ParticleBuffer& particles, float ft)
+{
+    constexpr float particlesPerSecond = 1200.0f;
+
+    auto& invisibles = manager.invisibleList;
+    auto& positions = manager.posList;
+    auto& rotations = manager.rotationList;
+    auto& scales = manager.scaleList;
+
+    for(auto& e : entities)
+    {
+        if(!invisibles[e].isVisible)
+            continue;
+
+        // Emit from the tip of the flame, backwards relative to the ship
+        float x = positions[e].x - rotations[e].dirX * scales[e].scale * 6.0f;
+        float y = positions[e].y - rotations[e].dirY * scales[e].scale * 6.0f;
+
+        emitParticles(particles, (std::size_t)(particlesPerSecond * ft), x, y,
+                rotations[e].dir + fastmath::pi, 0.3f, 100.0f, 250.0f, 0.1f, 0.4f);
+    }
+}
+
+// Scripted behaviors
+struct BehaviorScheduler
+{
+    float time = 0.0f;
+    std::vector<Behavior::Handle> ready;
+    std::vector<Entity> readyEntities;
+    BehaviorWorkers workers;
+};
+
+// The thread running the systems takes part in resuming behaviors, so one fewer than the cores
+inline std::size_t defaultBehaviorThreads()
+{
+    return std::max(1u, std::thread::hardware_concurrency()) - 1;
+}
+
+// What homing behaviors steer towards, written before the behaviors run
+struct BehaviorTarget
+{
+    float x, y;
+    bool valid;
+};
+
+ComponentBitset getRunBehaviorsBitset()
+{
+    ComponentBitset runBehaviorsBitset;
+    runBehaviorsBitset[getUniqueComponentId<CBehavior>()] = true;
+    return runBehaviorsBitset;
+}
+
+// Resume every behavior that is due. The frames of finished behaviors are released here.
+//
+// With workers the behaviors run in parallel, so they may only write the position, velocity and
+// rotation of their own entity. Those change columns are created up front for that reason.
+void runBehaviors(const std::vector<Entity>& entities, EntityManager& manager, BehaviorScheduler& scheduler, float ft)
+{
+    auto& behaviors = manager.behaviorList;
+
+    scheduler.time += ft;
+    const float time = scheduler.time;
+
+    scheduler.ready.clear();
+    scheduler.readyEntities.clear();
+
+    for(auto& e : entities)
+    {
+        if(!behaviors[e].behavior.handle() || behaviors[e].wakeTime > time)
+            continue;
+
+        scheduler.ready.push_back(behaviors[e].behavior.handle());
+        scheduler.readyEntities.push_back(e);
+    }
+
+    getChangeColumn<CPosition>(manager);
+    getChangeColumn<CVelocity>(manager);
+    getChangeColumn<CRotation>(manager);
+
+    scheduler.workers.run(scheduler.ready.size(), [&](std::size_t begin, std::size_t end)
+    {
+        for(std::size_t i = begin; i < end; i++)
+            resumeBehavior(scheduler.ready[i], scheduler.readyEntities[i], time);
+    });
+
+    for(std::size_t i = 0; i < scheduler.ready.size(); i++)
+    {
+        auto& behavior = behaviors[scheduler.readyEntities[i]];
+        if(scheduler.ready[i].done())
+            behavior.behavior.reset();
+        else
+            behavior.wakeTime = scheduler.ready[i].promise().state.wakeTime;
+    }
+}
+
+// Flies straight and picks a new heading every few seconds
+Behavior saucerBehavior(EntityManager& manager, float speed, uint32_t seed)
+{
+    BehaviorState& state = co_await behaviorState();
+
+    while(true)
+    {
+        float dirX, dirY;
+        fastmath::sinCos(particleRandom(seed) * fastmath::twoPi, dirY, dirX);
+
+        manager.velocityList[state.entity] = {dirX * speed, dirY * speed};
+        markChanged<CVelocity>(manager, state.entity);
+
+        co_await wait(1.0f + 2.0f * particleRandom(seed));
+    }
+}
+
+// Turns towards the target a little at a time without changing speed, across the window edges.
+// phase in [0, 1) spreads the re-aiming of many astroids over different frames.
+Behavior homingBehavior(EntityManager& manager, const BehaviorTarget& target, float turnRate, float phase)
+{
+    constexpr float aimInterval = 0.1f;
+
+    BehaviorState& state = co_await behaviorState();
+    co_await wait(phase * aimInterval);
+
+    while(true)
+    {
+        co_await wait(aimInterval);
+
+        if(!target.valid)
+            continue;
+
+        const auto& pos = manager.posList[state.entity];
+        auto& vel = manager.velocityList[state.entity];
+
+        float toX = target.x - pos.x;
+        float toY = target.y - pos.y;
+        toX -= std::nearbyint(toX / windowWidth) * windowWidth;
+        toY -= std::nearbyint(toY / windowHeight) * windowHeight;
+
+        const float distance = std::sqrt(toX * toX + toY * toY);
+        const float speed = std::sqrt(vel.xVel * vel.xVel + vel.yVel * vel.yVel);
+        if(distance < 1.0f || speed == 0.0f)
+            continue;
+
+        const float blend = std::min(1.0f, turnRate * state.ft);
+        float xVel = vel.xVel + (toX / distance * speed - vel.xVel) * blend;
+        float yVel = vel.yVel + (toY / distance * speed - vel.yVel) * blend;
+
+        const float newSpeed = std::sqrt(xVel * xVel + yVel * yVel);
+        if(newSpeed == 0.0f)
+            continue;
+
+        vel = {xVel / newSpeed * speed, yVel / newSpeed * speed};
+        markChanged<CVelocity>(manager, state.entity);
     }
 }
 
@@ -665,27 +1179,43 @@ ComponentBitset getMakeShapeDataFromEntitiesBitset()
     return makeDataFromEntitiesBitset;
 }
 
-void makeShapeDataFromEntities(const std::vector<Entity>& entities, EntityManager& manager, std::vector<float>& shapeData, std::vector<ShapeDrawInfo>& drawInfo)
+// changedEntities is the subset of entities whose position, scale, rotation or shape changed since
+// the last frame. Everything else reuses its transformed vertices from lastShapeData.
+void makeShapeDataFromEntities(const std::vector<Entity>& entities, const std::vector<Entity>& changedEntities, EntityManager& manager,
+        const std::vector<float>& lastShapeData, std::vector<float>& shapeData, std::vector<ShapeDrawInfo>& drawInfo)
 {
     auto& positions = manager.posList;
     auto& scales = manager.scaleList;
     auto& rotations = manager.rotationList;
     auto& shapes = manager.shapeList;
 
+    // Both lists are sorted the same way so the changed ones can be found by walking along
+    std::size_t nextChanged = 0;
+
     for(auto& e : entities)
     {
         std::size_t shapeIndex = (std::size_t)shapes[e].shape;
         auto& shapeDef = shapeDefs[shapeIndex];
 
+        const bool changed = nextChanged < changedEntities.size() && changedEntities[nextChanged] == e;
+        if(changed)
+            nextChanged++;
+
+        const std::size_t lastFromI = shapes[e].fromI;
+        const bool cached = !changed && shapes[e].toI <= lastShapeData.size() &&
+            shapes[e].toI - lastFromI == shapeDef.size();
+
         shapes[e].fromI = shapeData.size();
         shapes[e].toI = shapeData.size() + shapeDef.size();
 
         drawInfo.push_back({
-                scales[e].scale, rotations[e].dir, positions[e].x, positions[e].y,
-                shapes[e].color, shapes[e].fromI, shapes[e].toI});
+                scales[e].scale, rotations[e].dirX, rotations[e].dirY, positions[e].x, positions[e].y,
+                shapes[e].color, shapes[e].fromI, shapes[e].toI, cached});
 
-        for(auto& v : shapeDefs[shapeIndex])
-            shapeData.emplace_back(v);
+        if(cached)
+            shapeData.insert(shapeData.end(), lastShapeData.begin() + lastFromI, lastShapeData.begin() + lastFromI + shapeDef.size());
+        else
+            shapeData.insert(shapeData.end(), shapeDef.begin(), shapeDef.end());
     }
 }
 
@@ -705,7 +1235,7 @@ void addBulletsToShapeData(const std::vector<Entity>& entities, EntityManager& m
     for(auto& e : entities)
     {
         drawInfo.push_back({
-                1.0f, 0.0f, positions[e].x, positions[e].y,
+                1.0f, 1.0f, 0.0f, positions[e].x, positions[e].y,
                 bullets[e].color, shapeData.size(), shapeData.size() + 4});
 
         if(std::abs(bullets[e].xLast - positions[e].x) < windowWidth / 2.0f &&
@@ -719,215 +1249,1477 @@ void addBulletsToShapeData(const std::vector<Entity>& entities, EntityManager& m
     }
 }
 
-// CREATE ENTITES
-void createAstroid(EntityManager& manager, std::mt19937& randGen, float scale, float xPos, float yPos)
-{
-    std::uniform_real_distribution<float> speedDist(50.0f, 150.0f);
-    std::uniform_real_distribution<float> dirDist(0.0f, M_PI * 2.0f);
-    std::uniform_real_distribution<float> rotDist(-3.0f, 3.0f);
-    std::uniform_int_distribution<int> shapeDist((int)ShapeDef::FIRST_ASTROID, (int)ShapeDef::LAST_ASTROID);
-    std::uniform_real_distribution<float> posDist(-1.0f, 1.0f);
-
-    float velocity = speedDist(randGen);
-    float dir = dirDist(randGen);
-    float rotSpeed = rotDist(randGen);
-    int astroidId = shapeDist(randGen);
-    float posFactor = posDist(randGen);
+// Bullet collisions
 
-    if(xPos == 0.0f && yPos == 0.0f)
-    {
-        xPos = posFactor >= 0.0f ? posFactor * windowWidth : 0.0f;
-        yPos = posFactor < 0.0f ? -posFactor * windowHeight : 0.0f;
-    }
+struct BulletHit
+{
+    Entity bullet;
+    Entity target;
+    float x, y;
+};
 
-    Entity astroid = addEntity(manager);
+struct CollisionState
+{
+    CollisionGrid grid;
+    std::vector<Entity> boxEntities;        // Entity of every box in the grid
+    std::vector<CollisionSegment> trails;   // Unwrapped trail of every bullet
+    std::vector<BulletHit> hits;
+};
 
-    addCPosition(manager, astroid, {xPos, yPos});
-    addCVelocity(manager, astroid, {std::cos(dir) * velocity, std::sin(dir) * velocity});
-    addCScale(manager, astroid, {scale});
-    addCRotation(manager, astroid, {rotSpeed, dir});
-    addCShape(manager, astroid, {(std::size_t)astroidId, 0xFFFFFFFF});
+ComponentBitset getCollideBulletsBitset()
+{
+    ComponentBitset collideBulletsBitset;
+    collideBulletsBitset[getUniqueComponentId<CPosition>()] = true;
+    collideBulletsBitset[getUniqueComponentId<CVelocity>()] = true;
+    collideBulletsBitset[getUniqueComponentId<CBullet>()] = true;
+    collideBulletsBitset[getUniqueComponentId<CLifeTime>()] = true;
+    return collideBulletsBitset;
 }
 
-void createShip(EntityManager& manager)
+// Distance from the origin to the furthest vertex of every shape, for bounding boxes that don't
+// need the transformed vertices
+const std::vector<float>& getShapeRadii()
 {
-    constexpr float xStart = windowWidth / 2.0f, yStart = windowHeight / 2.0f;
-    constexpr float accelFactor = 600.0f, rotateFactor = 5.0f;
-    constexpr float scaleFactor = 3.0f;
-
-    Entity flame = addEntity(manager);
-
-    addCPosition(manager, flame, {xStart, yStart});
-    addCVelocity(manager, flame, {0.0f, 0.0f});
-    addCScale(manager, flame, {scaleFactor});
-    addCRotation(manager, flame, {0.0f, -M_PI/2.0f});
-    addCShape(manager, flame, {(std::size_t)ShapeDef::NONE, 0xFF0000FF});
-    addCControlMove(manager, flame, {accelFactor, rotateFactor});
-    addCInvisible(manager, flame, {false, (std::size_t)ShapeDef::FLAME});
-
-    Entity ship = addEntity(manager);
-
-    addCPosition(manager, ship, {xStart, yStart});
-    addCVelocity(manager, ship, {0.0f, 0.0f});
-    addCScale(manager, ship, {scaleFactor});
-    addCRotation(manager, ship, {0.0f, -M_PI/2.0f});
-    addCShape(manager, ship, {(std::size_t)ShapeDef::SHIP, 0x00FF00FF});
-    addCControlMove(manager, ship, {accelFactor, rotateFactor});
-    addCCanFire(manager, ship, {false});
+    static const std::vector<float> radii = []
+    {
+        std::vector<float> r(shapeDefs.size(), 0.0f);
+        for(std::size_t s = 0; s < shapeDefs.size(); s++)
+            for(std::size_t i = 0; i + 1 < shapeDefs[s].size(); i += 2)
+                r[s] = std::max(r[s], std::sqrt(shapeDefs[s][i] * shapeDefs[s][i] + shapeDefs[s][i+1] * shapeDefs[s][i+1]));
+        return r;
+    }();
+    return radii;
 }
 
-void createBullet(EntityManager& manager, float xPos, float yPos, float dir)
+// A trail can be longer than the window and wrap around its edges. Call visit once for every copy
+// of the window the unwrapped trail passes through, with the trail moved into that copy. Stops
+// when visit returns false.
+template<typename VisitFunc>
+void forEachWindowCopy(const CollisionSegment& trail, VisitFunc&& visit)
 {
-    constexpr float bulletSpeed = 1000.0f;
-
-    const float xVel = std::cos(dir) * bulletSpeed;
-    const float yVel = std::sin(dir) * bulletSpeed;
+    const int xFirst = (int)std::floor(std::min(trail.x0, trail.x1) / windowWidth);
+    const int xLast = (int)std::floor(std::max(trail.x0, trail.x1) / windowWidth);
+    const int yFirst = (int)std::floor(std::min(trail.y0, trail.y1) / windowHeight);
+    const int yLast = (int)std::floor(std::max(trail.y0, trail.y1) / windowHeight);
 
-    Entity bullet = addEntity(manager);
-
-    addCPosition(manager, bullet, {xPos, yPos});
-    addCVelocity(manager, bullet, {xVel, yVel});
-    addCBullet(manager, bullet, {xPos, yPos, 0xFFFF00FF});
-    addCLifeTime(manager, bullet, {0.5f});
+    for(int y = yFirst; y <= yLast; y++)
+    {
+        for(int x = xFirst; x <= xLast; x++)
+        {
+            const float xShift = (float)x * windowWidth, yShift = (float)y * windowHeight;
+            if(!visit(CollisionSegment{trail.x0 - xShift, trail.y0 - yShift, trail.x1 - xShift, trail.y1 - yShift}))
+                return;
+        }
+    }
 }
 
-int main(int argc, char** argv)
+// Sweep the trail of every bullet, from where it was last frame to where it is now, against the
+// astroid polygons in shapeData so fast bullets can't skip over an astroid at low frame rates.
+// The sweep is done relative to each astroid, which moved too during the frame.
+//
+// Every bullet hits at most the first astroid along its trail. Both are marked for removal and
+// the hit is appended to state.hits.
+void collideBullets(const std::vector<Entity>& bullets, const std::vector<Entity>& targets, EntityManager& manager,
+        const std::vector<float>& shapeData, CollisionState& state, float ft)
 {
-    renderer::init("dod_test", windowWidth, windowHeight);
+    auto& positions = manager.posList;
+    auto& velocities = manager.velocityList;
+    auto& scales = manager.scaleList;
+    auto& shapes = manager.shapeList;
+    auto& bulletList = manager.bulletList;
+    auto& lifeTimes = manager.lifeTimeList;
+    auto& markedForRemoval = manager.markedForRemoval;
+    auto& componentBitsets = manager.componentBitsets;
 
-    std::random_device rd;
-    std::mt19937 generator(rd());
+    state.hits.clear();
+    if(bullets.empty())
+        return;
 
-    using TimeRes = std::chrono::microseconds;
+    static const std::size_t velocityId = getUniqueComponentId<CVelocity>();
+    const auto& radii = getShapeRadii();
 
-    KeyMap keymap;
+    auto& grid = state.grid;
+    if(grid.cellStart.empty())
+        initCollisionGrid(grid, windowWidth, windowHeight, 32.0f);
 
-    EntityManager manager;
+    // Unwrap the trails. How many times a trail wrapped follows from the velocity, which is
+    // constant for bullets, and the time the trail covers. That is the frame time, except for
+    // bullets fired this frame, whose trail starts where they were fired and covers only their age.
+    state.trails.clear();
+    clearActiveCells(grid);
 
-    createShip(manager);
+    for(auto& b : bullets)
+    {
+        CollisionSegment trail = {bulletList[b].xLast, bulletList[b].yLast, positions[b].x, positions[b].y};
+        if(trail.x0 != trail.x1 || trail.y0 != trail.y1)
+        {
+            const float elapsed = std::min(ft, bulletLifeTime - lifeTimes[b].time);
+            trail.x0 += std::nearbyint((trail.x1 - velocities[b].xVel * elapsed - trail.x0) / windowWidth) * windowWidth;
+            trail.y0 += std::nearbyint((trail.y1 - velocities[b].yVel * elapsed - trail.y0) / windowHeight) * windowHeight;
+        }
+        state.trails.push_back(trail);
 
-    // Create entities
-    createAstroid(manager, generator, 10.0f);
-    createAstroid(manager, generator, 10.0f);
-    createAstroid(manager, generator, 10.0f);
-    createAstroid(manager, generator, 10.0f);
-    
-    createAstroid(manager, generator, 5.0f);
-    createAstroid(manager, generator, 5.0f);
-    createAstroid(manager, generator, 5.0f);
-    createAstroid(manager, generator, 5.0f);
-    createAstroid(manager, generator, 5.0f);
-    createAstroid(manager, generator, 5.0f);
-    createAstroid(manager, generator, 5.0f);
-    createAstroid(manager, generator, 5.0f);
-
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
-    createAstroid(manager, generator, 2.5f);
+        forEachWindowCopy(trail, [&](const CollisionSegment& seg)
+        {
+            activateCells(grid, boxOfSegment(seg));
+            return true;
+        });
+    }
 
-    
-    // Set up bitsets
-    
-    auto lifeTimeBitset = getLifeTimeEntitiesBitset();
-    auto saveLastPosBitset = getSaveLastPosBitset();
-    auto moveBitset = getMoveEntitiesBitset();
-    auto rotateBitset = getRotateEntitiesBitset();
-    auto controlMoveBitset = getControllMoveEntitiesBitset();
-    auto invisibleControllBitset = getShowInvisibleEntitiesBitset();
-    auto canFireBitset = getFireingEntitiesBitset();
-    auto makeDataFromEntitiesBitset = getMakeShapeDataFromEntitiesBitset();
-    auto addBulletToShapeDataBitset = getAddBulletsToShapeDataBitset();
-
-    // To use in rendering
-    std::vector<float> shapeData;
-    std::vector<ShapeDrawInfo> drawInfo;
+    finishActiveCells(grid);
+
+    // Broad phase, a loose box around every astroid stretched back over its movement this frame.
+    // Only astroids near a trail go into the grid.
+    // Written without branches on the result since about half of a dense field is kept
+    grid.boxes.resize(targets.size());
+    state.boxEntities.resize(targets.size());
+    std::size_t boxCount = 0;
+
+    for(auto& e : targets)
+    {
+        const std::size_t shape = shapes[e].shape;
+        const bool isAstroid = shape >= (std::size_t)ShapeDef::FIRST_ASTROID && shape <= (std::size_t)ShapeDef::LAST_ASTROID;
+
+        const float r = radii[shape] * scales[e].scale;
+        float xMove = 0.0f, yMove = 0.0f;
+        if(componentBitsets[e][velocityId])
+        {
+            xMove = velocities[e].xVel * ft;
+            yMove = velocities[e].yVel * ft;
+        }
+
+        const CollisionBox box = {
+            positions[e].x - r - std::max(xMove, 0.0f), positions[e].y - r - std::max(yMove, 0.0f),
+            positions[e].x + r - std::min(xMove, 0.0f), positions[e].y + r - std::min(yMove, 0.0f)};
+
+        grid.boxes[boxCount] = box;
+        state.boxEntities[boxCount] = e;
+        boxCount += isAstroid && overlapsActiveCell(grid, box);
+    }
+
+    grid.boxes.resize(boxCount);
+    state.boxEntities.resize(boxCount);
+
+    if(grid.boxes.empty())
+        return;
+
+    buildCollisionGrid(grid);
+
+    // Narrow phase
+    for(std::size_t i = 0; i < bullets.size(); i++)
+    {
+        const Entity b = bullets[i];
+        if(markedForRemoval[b])
+            continue;
+
+        float firstT = 2.0f;
+        BulletHit hit;
+
+        forEachWindowCopy(state.trails[i], [&](const CollisionSegment& seg)
+        {
+            queryCollisionGrid(grid, boxOfSegment(seg), [&](uint32_t c)
+            {
+                const Entity a = state.boxEntities[c];
+                if(markedForRemoval[a])
+                    return true;
+
+                // Start of the trail as seen from where the astroid is now
+                float sx = seg.x0, sy = seg.y0;
+                if(componentBitsets[a][velocityId])
+                {
+                    sx += velocities[a].xVel * ft;
+                    sy += velocities[a].yVel * ft;
+                }
+
+                // Where the trail enters the bounding circle, a polygon can't be hit any earlier
+                const float r = radii[shapes[a].shape] * scales[a].scale;
+                if(!sweepCircleEntry(sx, sy, seg.x1, seg.y1, positions[a].x, positions[a].y, r, firstT))
+                    return true;
+
+                const float t = sweepSegmentPolygon(sx, sy, seg.x1, seg.y1, shapeData.data(), shapes[a].fromI, shapes[a].toI);
+                if(t < firstT)
+                {
+                    firstT = t;
+                    hit = {b, a, sx + (seg.x1 - sx) * t, sy + (seg.y1 - sy) * t};
+                }
+
+                // In a dense field the trail often starts inside an astroid, nothing beats that
+                return firstT > 0.0f;
+            });
+
+            return firstT > 0.0f;
+        });
+
+        if(firstT <= 1.0f)
+        {
+            markedForRemoval[hit.bullet] = true;
+            markedForRemoval[hit.target] = true;
+            state.hits.push_back(hit);
+        }
+    }
+}
+
+// Blow up the astroids that were hit, big ones split in two smaller ones. The fragments of all
+// hits are spawned in one batch so the groups are extended instead of rebuilt.
+void destroyAstroids(const std::vector<BulletHit>& hits, EntityManager& manager, CounterRandom& random, ParticleBuffer& particles)
+{
+    constexpr float smallestScale = 2.5f;
 
-    bool windowOpen = true;
-    while(windowOpen)
+    std::size_t fragmentCount = 0;
+    for(auto& hit : hits)
+    {
+        const float scale = manager.scaleList[hit.target].scale;
+
+        emitParticles(particles, (std::size_t)(40.0f * scale), hit.x, hit.y,
+                0.0f, fastmath::pi, 20.0f, 120.0f + 10.0f * scale, 0.3f, 0.9f);
+
+        if(scale > smallestScale)
+            fragmentCount += 2;
+    }
+
+    if(fragmentCount == 0)
+        return;
+
+    EntityRange range = createAstroids(manager, random, fragmentCount, smallestScale);
+
+    Entity fragment = range.first;
+    for(auto& hit : hits)
+    {
+        const float scale = manager.scaleList[hit.target].scale;
+        if(scale <= smallestScale)
+            continue;
+
+        for(int i = 0; i < 2; i++, fragment++)
+        {
+            manager.posList[fragment] = manager.posList[hit.target];
+            manager.scaleList[fragment] = {scale / 2.0f};
+        }
+    }
+}
+
+// Network snapshots use this shape id for bullets, which are drawn as a trail instead of a shape
+constexpr uint8_t netBulletShape = 0xFF;
+
+void makeSnapshotFromEntities(const std::vector<Entity>& shapeEntities, const std::vector<Entity>& bulletEntities,
+        EntityManager& manager, Snapshot& snapshot)
+{
+    auto& ids = manager.idList;
+    auto& positions = manager.posList;
+    auto& velocities = manager.velocityList;
+    auto& scales = manager.scaleList;
+    auto& rotations = manager.rotationList;
+    auto& shapes = manager.shapeList;
+    auto& bullets = manager.bulletList;
+
+    snapshot.entities.clear();
+    snapshot.entities.reserve(shapeEntities.size() + bulletEntities.size());
+
+    for(auto& e : shapeEntities)
+    {
+        snapshot.entities.push_back({
+                ids[e], quantizePos(positions[e].x), quantizePos(positions[e].y),
+                quantizeVel(velocities[e].xVel), quantizeVel(velocities[e].yVel),
+                quantizeDir(rotations[e].dir), (uint8_t)shapes[e].shape,
+                quantizeScale(scales[e].scale), shapes[e].color});
+    }
+
+    for(auto& e : bulletEntities)
+    {
+        snapshot.entities.push_back({
+                ids[e], quantizePos(positions[e].x), quantizePos(positions[e].y),
+                quantizeVel(velocities[e].xVel), quantizeVel(velocities[e].yVel),
+                0, netBulletShape, 0, bullets[e].color});
+    }
+
+    std::sort(snapshot.entities.begin(), snapshot.entities.end(),
+            [](const NetEntity& a, const NetEntity& b) { return a.id < b.id; });
+}
+
+// Keep the entities within radius pixels of (x, y), measured across the wrapping window edges
+void filterSnapshot(const Snapshot& world, float x, float y, float radius, Snapshot& out)
+{
+    out.tick = world.tick;
+    out.entities.clear();
+
+    if(radius <= 0.0f)
+    {
+        out.entities = world.entities;
+        return;
+    }
+
+    const float r2 = radius * radius;
+    for(auto& e : world.entities)
+    {
+        float dx = std::abs(dequantizePos(e.x) - x);
+        float dy = std::abs(dequantizePos(e.y) - y);
+        dx = std::min(dx, windowWidth - dx);
+        dy = std::min(dy, windowHeight - dy);
+
+        if(dx * dx + dy * dy <= r2)
+            out.entities.push_back(e);
+    }
+}
+
+void makeShapeDataFromSnapshot(const Snapshot& snapshot, std::vector<float>& shapeData, std::vector<ShapeDrawInfo>& drawInfo)
+{
+    for(auto& e : snapshot.entities)
+    {
+        if(e.shape == netBulletShape || e.shape >= shapeDefs.size())
+            continue;
+
+        auto& shapeDef = shapeDefs[e.shape];
+
+        float dirX, dirY;
+        fastmath::sinCos(dequantizeDir(e.dir), dirY, dirX);
+
+        drawInfo.push_back({
+                dequantizeScale(e.scale), dirX, dirY, dequantizePos(e.x), dequantizePos(e.y),
+                e.color, shapeData.size(), shapeData.size() + shapeDef.size()});
+
+        for(auto& v : shapeDef)
+            shapeData.emplace_back(v);
+    }
+}
+
+void addSnapshotBulletsToShapeData(const Snapshot& snapshot, std::vector<float>& shapeData, std::vector<ShapeDrawInfo>& drawInfo)
+{
+    constexpr float trailTime = 1.0f / 60.0f;
+
+    for(auto& e : snapshot.entities)
+    {
+        if(e.shape != netBulletShape)
+            continue;
+
+        float x = dequantizePos(e.x);
+        float y = dequantizePos(e.y);
+
+        drawInfo.push_back({
+                1.0f, 1.0f, 0.0f, x, y,
+                e.color, shapeData.size(), shapeData.size() + 4});
+
+        shapeData.emplace_back(x - dequantizeVel(e.xVel) * trailTime);
+        shapeData.emplace_back(y - dequantizeVel(e.yVel) * trailTime);
+        shapeData.emplace_back(x);
+        shapeData.emplace_back(y);
+    }
+}
+
+// CREATE ENTITES
+
+// Every spawned entity takes one random index and draws its numbers from these streams at it
+enum SpawnStream : uint32_t
+{
+    SPAWN_MOTION = 0,       // Speed, direction, rotation speed, shape
+    SPAWN_PLACEMENT = 1,    // Scale and two words for the position
+    SPAWN_EXTRA = 2         // Whatever else an archetype needs
+};
+
+// Bulk spawning draws random numbers for this many entities at a time, the scratch fits the stack
+constexpr std::size_t spawnRandomChunk = 256;
+
+CPosition samplePlacement(ScenePlacement placement, uint32_t word0, uint32_t word1)
+{
+    if(placement == ScenePlacement::UNIFORM)
+        return {randomUnit(word0) * windowWidth, randomUnit(word1) * windowHeight};
+
+    float posFactor = randomRange(word0, -1.0f, 1.0f);
+    return {posFactor >= 0.0f ? posFactor * windowWidth : 0.0f, posFactor < 0.0f ? -posFactor * windowHeight : 0.0f};
+}
+
+EntityRange createAstroids(EntityManager& manager, CounterRandom& random, std::size_t count, float scale)
+{
+    return createAstroids(manager, random, count,
+            {scale, scale, 50.0f, 150.0f, -3.0f, 3.0f, ScenePlacement::EDGE, 0xFFFFFFFF});
+}
+
+// extraComponents are added to the archetype, for callers that fill in more components.
+// The numbers are made a chunk at a time, four entities per Philox call, and the directions
+// go through the bulk sinCos.
+EntityRange createAstroids(EntityManager& manager, CounterRandom& random, std::size_t count, const SpawnDistribution& dist,
+        ComponentBitset extraComponents)
+{
+    static const ComponentBitset archetype = makeArchetype<CPosition, CVelocity, CScale, CRotation, CShape>();
+
+    EntityRange range = addEntities(manager, count, archetype | extraComponents);
+    const uint64_t firstIndex = takeRandomIndices(random, count);
+
+    auto& positions = manager.posList;
+    auto& velocities = manager.velocityList;
+    auto& scales = manager.scaleList;
+    auto& rotations = manager.rotationList;
+    auto& shapes = manager.shapeList;
+
+    alignas(16) uint32_t motion[4][spawnRandomChunk];
+    alignas(16) uint32_t placement[4][spawnRandomChunk];
+    uint32_t* const motionWords[4] = {motion[0], motion[1], motion[2], motion[3]};
+    uint32_t* const placementWords[4] = {placement[0], placement[1], placement[2], placement[3]};
+    float dirs[spawnRandomChunk], dirXs[spawnRandomChunk], dirYs[spawnRandomChunk];
+
+    for(std::size_t chunk = 0; chunk < count; chunk += spawnRandomChunk)
+    {
+        const std::size_t n = std::min(spawnRandomChunk, count - chunk);
+        randomBlocks(random, firstIndex + chunk, SPAWN_MOTION, n, motionWords);
+        randomBlocks(random, firstIndex + chunk, SPAWN_PLACEMENT, n, placementWords);
+
+        for(std::size_t i = 0; i < n; i++)
+            dirs[i] = randomUnit(motion[1][i]) * fastmath::twoPi;
+        fastmath::sinCos(dirs, dirYs, dirXs, n);
+
+        for(std::size_t i = 0; i < n; i++)
+        {
+            const Entity e = range.first + chunk + i;
+            const float velocity = randomRange(motion[0][i], dist.speedMin, dist.speedMax);
+            const float rotSpeed = randomRange(motion[2][i], dist.rotationMin, dist.rotationMax);
+            const int astroidId = randomInt(motion[3][i], (int)ShapeDef::FIRST_ASTROID, (int)ShapeDef::LAST_ASTROID);
+
+            positions[e] = samplePlacement(dist.placement, placement[1][i], placement[2][i]);
+            velocities[e] = {dirXs[i] * velocity, dirYs[i] * velocity};
+            scales[e] = {randomRange(placement[0][i], dist.scaleMin, dist.scaleMax)};
+            rotations[e] = {rotSpeed, dirs[i], dirXs[i], dirYs[i]};
+            shapes[e] = {(std::size_t)astroidId, dist.color};
+        }
+    }
+
+    return range;
+}
+
+// Astroids that steer towards target
+EntityRange createHomingAstroids(EntityManager& manager, CounterRandom& random, std::size_t count, const SpawnDistribution& dist,
+        const BehaviorTarget& target)
+{
+    constexpr float turnRate = 1.5f;
+
+    const uint64_t firstIndex = random.next;
+    EntityRange range = createAstroids(manager, random, count, dist, makeArchetype<CBehavior>());
+
+    for(std::size_t i = 0; i < range.count; i++)
+    {
+        const float phase = randomUnit(randomBlock(random, firstIndex + i, SPAWN_EXTRA)[0]);
+        manager.behaviorList[range.first + i] = {homingBehavior(manager, target, turnRate, phase), 0.0f};
+    }
+
+    return range;
+}
+
+EntityRange createSaucers(EntityManager& manager, CounterRandom& random, std::size_t count, const SpawnDistribution& dist)
+{
+    static const ComponentBitset archetype = makeArchetype<CPosition, CVelocity, CScale, CRotation, CShape, CBehavior>();
+
+    EntityRange range = addEntities(manager, count, archetype);
+    const uint64_t firstIndex = takeRandomIndices(random, count);
+
+    for(std::size_t i = 0; i < range.count; i++)
+    {
+        const Entity e = range.first + i;
+        const philox::Block motion = randomBlock(random, firstIndex + i, SPAWN_MOTION);
+        const philox::Block placement = randomBlock(random, firstIndex + i, SPAWN_PLACEMENT);
+
+        manager.posList[e] = samplePlacement(dist.placement, placement[1], placement[2]);
+        manager.velocityList[e] = {0.0f, 0.0f};
+        manager.scaleList[e] = {randomRange(placement[0], dist.scaleMin, dist.scaleMax)};
+        manager.rotationList[e] = {0.0f, 0.0f, 1.0f, 0.0f};
+        manager.shapeList[e] = {(std::size_t)ShapeDef::SAUCER, dist.color};
+        manager.behaviorList[e] = {saucerBehavior(manager, randomRange(motion[0], dist.speedMin, dist.speedMax), motion[1] | 1), 0.0f};
+    }
+
+    return range;
+}
+
+// Every ship is two entities, its flame first and then the ship itself. All flames and all ships
+// are added in one batch each.
+void createShips(EntityManager& manager, std::size_t count)
+{
+    static const ComponentBitset flameArchetype =
+        makeArchetype<CPosition, CVelocity, CScale, CRotation, CShape, CControlMove, CControlInvisible>();
+    static const ComponentBitset shipArchetype =
+        makeArchetype<CPosition, CVelocity, CScale, CRotation, CShape, CControlMove, CControlFire>();
+
+    constexpr float xStart = windowWidth / 2.0f, yStart = windowHeight / 2.0f;
+    constexpr float accelFactor = 600.0f, rotateFactor = 5.0f;
+    constexpr float scaleFactor = 3.0f;
+
+    CRotation rotation = {0.0f, -M_PI/2.0f};
+    fastmath::sinCos(rotation.dir, rotation.dirY, rotation.dirX);
+
+    EntityRange flames = addEntities(manager, count, flameArchetype);
+    fillComponents(manager.posList, flames, {xStart, yStart});
+    fillComponents(manager.velocityList, flames, {0.0f, 0.0f});
+    fillComponents(manager.scaleList, flames, {scaleFactor});
+    fillComponents(manager.rotationList, flames, rotation);
+    fillComponents(manager.shapeList, flames, {(std::size_t)ShapeDef::NONE, 0xFF0000FF});
+    fillComponents(manager.moveList, flames, {accelFactor, rotateFactor});
+    fillComponents(manager.invisibleList, flames, {false, (std::size_t)ShapeDef::FLAME});
+
+    EntityRange ships = addEntities(manager, count, shipArchetype);
+    fillComponents(manager.posList, ships, {xStart, yStart});
+    fillComponents(manager.velocityList, ships, {0.0f, 0.0f});
+    fillComponents(manager.scaleList, ships, {scaleFactor});
+    fillComponents(manager.rotationList, ships, rotation);
+    fillComponents(manager.shapeList, ships, {(std::size_t)ShapeDef::SHIP, 0x00FF00FF});
+    fillComponents(manager.moveList, ships, {accelFactor, rotateFactor});
+    fillComponents(manager.canFireList, ships, {false});
+}
+
+// age is how long ago the bullet was fired, it has moved that far already and the trail covers
+// the whole way from the start position
+void createBullet(EntityManager& manager, float xPos, float yPos, float dirX, float dirY, float age)
+{
+    constexpr float bulletSpeed = 1000.0f;
+
+    const float xVel = dirX * bulletSpeed;
+    const float yVel = dirY * bulletSpeed;
+
+    Entity bullet = addEntity(manager);
+
+    addCPosition(manager, bullet, {xPos + xVel * age, yPos + yVel * age});
+    addCVelocity(manager, bullet, {xVel, yVel});
+    addCBullet(manager, bullet, {xPos, yPos, 0xFFFF00FF});
+    addCLifeTime(manager, bullet, {bulletLifeTime - age});
+}
+
+// Ship plus astroidCount astroids in the same size mix as the original 4/8/17 field
+Scene makeDefaultScene(std::size_t astroidCount)
+{
+    const std::size_t large = astroidCount * 4 / 29;
+    const std::size_t medium = astroidCount * 8 / 29;
+    const std::size_t counts[] = {large, medium, astroidCount - large - medium};
+    const float scales[] = {10.0f, 5.0f, 2.5f};
+
+    Scene scene;
+
+    SceneWave ship = defaultSceneWave();
+    ship.archetype = SceneArchetype::SHIP;
+    scene.waves.push_back(ship);
+
+    for(int i = 0; i < 3; i++)
+    {
+        if(counts[i] == 0)
+            continue;
+
+        SceneWave wave = defaultSceneWave();
+        wave.count = counts[i];
+        wave.distribution.scaleMin = wave.distribution.scaleMax = scales[i];
+        scene.waves.push_back(wave);
+    }
+
+    return scene;
+}
+
+// Streams the waves of a scene into the world, spreading big waves over several frames
+struct SceneSpawner
+{
+    Scene scene;
+    std::size_t nextWave = 0;
+    std::size_t spawnedOfWave = 0;
+    float time = 0.0f;
+};
+
+void startScene(SceneSpawner& spawner, EntityManager& manager)
+{
+    spawner.nextWave = 0;
+    spawner.spawnedOfWave = 0;
+    spawner.time = 0.0f;
+
+    // Reserving only allocates, it doesn't touch the memory, so this is cheap even for huge scenes
+    std::size_t total = manager.componentBitsets.size();
+    for(auto& wave : spawner.scene.waves)
+        total += wave.archetype == SceneArchetype::SHIP ? wave.count * 2 : wave.count;   // Ship and flame
+    reserveEntities(manager, total);
+}
+
+bool sceneFinished(const SceneSpawner& spawner)
+{
+    return spawner.nextWave >= spawner.scene.waves.size();
+}
+
+// About a million entities a second while keeping the spawn cost of a frame to a few milliseconds
+constexpr std::size_t spawnBudgetPerFrame = 1 << 14;
+
+// Spawn at most budget entities from the waves that are due
+void spawnSceneWaves(SceneSpawner& spawner, EntityManager& manager, const BehaviorTarget& target, CounterRandom& random,
+        float ft, std::size_t budget)
+{
+    spawner.time += ft;
+
+    while(budget > 0 && !sceneFinished(spawner))
+    {
+        const SceneWave& wave = spawner.scene.waves[spawner.nextWave];
+        if(wave.time > spawner.time)
+            break;
+
+        // A ship is two entities and costs both
+        const std::size_t cost = wave.archetype == SceneArchetype::SHIP ? 2 : 1;
+        const std::size_t count = std::min<std::size_t>(budget / cost, wave.count - spawner.spawnedOfWave);
+        if(count == 0)
+            break;
+
+        switch(wave.archetype)
+        {
+            case SceneArchetype::ASTROID:
+                createAstroids(manager, random, count, wave.distribution);
+                break;
+            case SceneArchetype::SHIP:
+                createShips(manager, count);
+                break;
+            case SceneArchetype::SAUCER:
+                createSaucers(manager, random, count, wave.distribution);
+                break;
+            case SceneArchetype::HOMING_ASTROID:
+                createHomingAstroids(manager, random, count, wave.distribution, target);
+                break;
+        }
+
+        budget -= count * cost;
+        spawner.spawnedOfWave += count;
+
+        if(spawner.spawnedOfWave == wave.count)
+        {
+            spawner.nextWave++;
+            spawner.spawnedOfWave = 0;
+        }
+    }
+}
+
+// Per world state of the systems that only process what changed since their last run
+struct SystemState
+{
+    ChangeQuery invisibleQuery;
+    ChangeQuery fireQuery;
+
+    BehaviorScheduler behaviors;
+    BehaviorTarget player = {0.0f, 0.0f, false};    // The first controllable ship
+};
+
+// Run every gameplay system once
+void updateEntities(EntityManager& manager, SystemState& systems, const FrameInput& input, float frameTime)
+{
+    static const auto lifeTimeBitset = getLifeTimeEntitiesBitset();
+    static const auto saveLastPosBitset = getSaveLastPosBitset();
+    static const auto moveBitset = getMoveEntitiesBitset();
+    static const auto rotateBitset = getRotateEntitiesBitset();
+    static const auto controlMoveBitset = getControllMoveEntitiesBitset();
+    static const auto invisibleControllBitset = getShowInvisibleEntitiesBitset();
+    static const auto canFireBitset = getFireingEntitiesBitset();
+    static const auto invisibleChangedBitset = makeArchetype<CControlInvisible>();
+    static const auto canFireChangedBitset = makeArchetype<CControlFire>();
+    static const auto runBehaviorsBitset = getRunBehaviorsBitset();
+
+    removeEntities(manager);
+
+    auto& lifeTimeSysEntities = getEntitesForSystem(manager, lifeTimeBitset);
+    lifeTimeEntities(lifeTimeSysEntities, manager, frameTime);
+
+    auto& controllerSysEntites = getEntitesForSystem(manager, controlMoveBitset);
+    systems.player.valid = !controllerSysEntites.empty();
+    if(systems.player.valid)
+    {
+        systems.player.x = manager.posList[controllerSysEntites.front()].x;
+        systems.player.y = manager.posList[controllerSysEntites.front()].y;
+    }
+
+    auto& runBehaviorsSysEntities = getEntitesForSystem(manager, runBehaviorsBitset);
+    runBehaviors(runBehaviorsSysEntities, manager, systems.behaviors, frameTime);
+
+    auto& saveLastPosSysEntities = getEntitesForSystem(manager, saveLastPosBitset);
+    saveLastPos(saveLastPosSysEntities, manager);
+
+    auto& moveSysEntities = getEntitesForSystem(manager, moveBitset);
+    moveEntities(moveSysEntities, manager, frameTime);
+
+    auto& rotateSysEntities = getEntitesForSystem(manager, rotateBitset);
+    rotateEntites(rotateSysEntities, manager, frameTime);
+
+    controllEnities(controllerSysEntites, manager, input, frameTime);
+
+    // These two only react to a key going up or down, so unless the key changed during the step
+    // they only need to look at entities whose control state was written, like newly created ones
+    auto& invisibleControllSysEntities = getEntitesForSystem(manager, invisibleControllBitset);
+    auto& changedInvisibleEntities = getChangedEntities(manager, invisibleControllSysEntities, invisibleChangedBitset, systems.invisibleQuery);
+    showInvisibleEntities(hasKeyEvents(input, SDLK_UP) ? invisibleControllSysEntities : changedInvisibleEntities, manager, input.keys);
+
+    auto& canFireSysEntities = getEntitesForSystem(manager, canFireBitset);
+    auto& changedCanFireEntities = getChangedEntities(manager, canFireSysEntities, canFireChangedBitset, systems.fireQuery);
+    fireingEntities(hasKeyEvents(input, SDLK_SPACE) ? canFireSysEntities : changedCanFireEntities, manager, input, frameTime);
+}
+
+
+// METRICS EXPORT
+constexpr float metricsInterval = 1.0f;
+
+// Names for the archetype labels, listed in declaration order so labels don't depend on the
+// order the component ids were handed out in
+const std::vector<std::pair<std::size_t, const char*>>& getComponentNames()
+{
+    static const std::vector<std::pair<std::size_t, const char*>> names = {
+        {getUniqueComponentId<CPosition>(), "position"},
+        {getUniqueComponentId<CVelocity>(), "velocity"},
+        {getUniqueComponentId<CScale>(), "scale"},
+        {getUniqueComponentId<CRotation>(), "rotation"},
+        {getUniqueComponentId<CShape>(), "shape"},
+        {getUniqueComponentId<CControlMove>(), "control_move"},
+        {getUniqueComponentId<CControlInvisible>(), "control_invisible"},
+        {getUniqueComponentId<CBullet>(), "bullet"},
+        {getUniqueComponentId<CLifeTime>(), "life_time"},
+        {getUniqueComponentId<CControlFire>(), "control_fire"},
+        {getUniqueComponentId<CBehavior>(), "behavior"}};
+    return names;
+}
+
+void writeEcsMetrics(const EntityManager& manager, std::string& out)
+{
+    const auto& metrics = manager.metrics;
+
+    writeMetric(out, "ecs_entities", "gauge", "Live entities.", manager.componentBitsets.size());
+
+    // Entities per archetype, counted here so entity creation doesn't pay for it
+    std::unordered_map<ComponentBitset, std::size_t> archetypes;
+    for(auto& bitset : manager.componentBitsets)
+        archetypes[bitset]++;
+
+    writeMetricHeader(out, "ecs_archetype_entities", "gauge", "Live entities per archetype.");
+    for(auto& it : archetypes)
+    {
+        std::string labels = "archetype=\"";
+        bool first = true;
+        for(auto& name : getComponentNames())
+        {
+            if(!it.first[name.first])
+                continue;
+            if(!first)
+                labels += '+';
+            labels += name.second;
+            first = false;
+        }
+        labels += '"';
+
+        writeMetricSample(out, "ecs_archetype_entities", it.second, labels.c_str());
+    }
+
+    writeMetric(out, "ecs_groups", "gauge", "Entity groups known to getEntitesForSystem.", manager.groupMap.size());
+    writeMetric(out, "ecs_group_cache_hits_total", "counter",
+            "getEntitesForSystem calls answered from a cached group.", metrics.groupHits);
+    writeMetric(out, "ecs_group_cache_rebuilds_total", "counter",
+            "getEntitesForSystem calls that scanned every entity.", metrics.groupRebuilds);
+    writeMetric(out, "ecs_group_cache_invalidations_total", "counter",
+            "Times every cached group was thrown away.", metrics.groupInvalidations);
+    writeMetric(out, "ecs_component_reallocations_total", "counter",
+            "Times the component vectors were reallocated to grow.", metrics.reallocations);
+    writeMetric(out, "ecs_entities_removed_total", "counter", "Entities removed.", metrics.removed);
+    writeMetric(out, "ecs_entities_removed_last_frame", "gauge",
+            "Entities removed in the latest frame.", metrics.removedLastFrame);
+    writeHistogram(out, "frame_time_seconds", "Frame time returned by limitFps.", metrics.frameTimes);
+}
+
+// Publish once every metricsInterval seconds, sinceLast carries the time between calls
+void publishMetrics(MetricsPublisher& publisher, const EntityManager& manager, float& sinceLast, float ft)
+{
+    sinceLast += ft;
+    if(!publisher.isOpen() || sinceLast < metricsInterval)
+        return;
+
+    sinceLast = 0.0f;
+
+    std::string text;
+    writeEcsMetrics(manager, text);
+    if(!publisher.publish(text))
+        std::cerr << "Could not publish metrics" << std::endl;
+}
+
+// FRAME CAPTURE
+void openCapture(FrameCapture& capture, const char* target, int every)
+{
+    if(target && !capture.open(target, windowWidth, windowHeight, 60, every))
+        std::cerr << "Could not open capture target " << target << std::endl;
+}
+
+void finishCapture(FrameCapture& capture)
+{
+    if(!capture.isOpen())
+        return;
+
+    capture.close();
+    std::cout << "Captured " << capture.written() << " frames, dropped " << capture.dropped() << std::endl;
+}
+
+// NETWORKING
+constexpr uint16_t defaultServerPort = 27015;
+constexpr std::size_t snapshotHistorySize = 32;
+constexpr uint32_t clientTimeoutTicks = 5 * 60;
+
+// Keys sent from the clients, packed in one byte
+constexpr unsigned int netKeys[] = {SDLK_UP, SDLK_LEFT, SDLK_RIGHT, SDLK_SPACE};
+
+struct NetClient
+{
+    NetAddress address;
+    uint32_t ackTick;
+    uint32_t lastHeardTick;
+    uint8_t keys;
+
+    // Interest area, a radius of 0 means the whole world
+    float viewX, viewY, viewRadius;
+
+    // What was sent to this client, indexed by tick % snapshotHistorySize
+    std::array<Snapshot, snapshotHistorySize> history;
+    std::size_t bytesSent;
+};
+
+// Headless authoritative simulation that streams delta compressed snapshots to every client
+int runServer(uint16_t port, const Scene& scene, const char* metricsTarget)
+{
+    UdpSocket socket;
+    if(!socket.open(port))
+    {
+        std::cerr << "Could not open UDP port " << port << std::endl;
+        return 1;
+    }
+
+    std::cout << "Server on port " << port << " with " << scene.waves.size() << " spawn waves" << std::endl;
+
+    std::random_device rd;
+    CounterRandom spawnRandom = {(uint64_t)rd() << 32 | rd(), 0};
+
+    using ClockType = std::chrono::steady_clock;
+    using TimeRes = std::chrono::microseconds;
+
+    EntityManager manager;
+    SystemState systems;
+    systems.behaviors.workers.start(defaultBehaviorThreads());
+
+    SceneSpawner spawner;
+    spawner.scene = scene;
+    startScene(spawner, manager);
+
+    static const auto makeDataFromEntitiesBitset = getMakeShapeDataFromEntitiesBitset();
+    static const auto addBulletToShapeDataBitset = getAddBulletsToShapeDataBitset();
+
+    std::vector<std::unique_ptr<NetClient>> clients;
+    FrameInput input;
+
+    Snapshot worldSnapshot;
+    Snapshot clientSnapshot;
+    std::vector<uint8_t> message;
+    uint8_t packet[2048];
+
+    uint32_t tick = 0;
+    ClockType::duration tickCost{};
+
+    MetricsPublisher metrics;
+    float sinceMetrics = 0.0f;
+    if(metricsTarget && !metrics.open(metricsTarget))
+        std::cerr << "Could not open metrics target " << metricsTarget << std::endl;
+
+    while(true)
     {
-        // Timing
         auto ticks = limitFps<TimeRes, 60>();
         float frameTime = ticks / 1000000.0f;
+        observe(manager.metrics.frameTimes, frameTime);
 
-        // Input
-        SDL_Event e;
-        while(SDL_PollEvent(&e))
+        auto tickStart = ClockType::now();
+        tick++;
+
+        // Acks carry the last complete snapshot, the interest area and the pressed keys
+        NetAddress from;
+        while(std::size_t size = socket.receive(from, packet, sizeof(packet)))
         {
-            switch(e.type)
+            ByteReader r{packet, size, 0, false};
+            if(r.u8() != netAckPacket)
+                continue;
+
+            uint32_t ackTick = r.u32();
+            float viewX = dequantizePos(r.u16());
+            float viewY = dequantizePos(r.u16());
+            float viewRadius = r.u16();
+            uint8_t keys = r.u8();
+            if(r.failed)
+                continue;
+
+            auto it = std::find_if(clients.begin(), clients.end(),
+                    [&](const std::unique_ptr<NetClient>& c) { return c->address == from; });
+
+            if(it == clients.end())
             {
-                case SDL_QUIT:
-                    windowOpen = false;
-                    break;
-                case SDL_KEYDOWN:
-                    keymap[e.key.keysym.sym] = true;
-                    break;
-                case SDL_KEYUP:
-                    keymap[e.key.keysym.sym] = false;
-                    break;
+                clients.emplace_back(new NetClient{from});
+                it = clients.end() - 1;
+                std::cout << "Client connected from port " << from.port << std::endl;
             }
+
+            NetClient& client = **it;
+            client.ackTick = std::max(client.ackTick, ackTick);
+            client.lastHeardTick = tick;
+            client.keys = keys;
+            client.viewX = viewX;
+            client.viewY = viewY;
+            client.viewRadius = viewRadius;
         }
 
-        // Update
-        removeEntities(manager);
+        clients.erase(std::remove_if(clients.begin(), clients.end(),
+                    [&](const std::unique_ptr<NetClient>& c) { return tick - c->lastHeardTick > clientTimeoutTicks; }),
+                clients.end());
 
-        auto& lifeTimeSysEntities = getEntitesForSystem(manager, lifeTimeBitset);
-        lifeTimeEntities(lifeTimeSysEntities, manager, frameTime);
-        
-        auto& saveLastPosSysEntities = getEntitesForSystem(manager, saveLastPosBitset);
-        saveLastPos(saveLastPosSysEntities, manager);
+        // Every client steers the same ship
+        input.events.clear();
+        for(std::size_t k = 0; k < std::size(netKeys); k++)
+        {
+            bool down = false;
+            for(auto& client : clients)
+                down = down || (client->keys & (1 << k));
+
+            setFrameKey(input, netKeys[k], down);
+        }
+
+        spawnSceneWaves(spawner, manager, systems.player, spawnRandom, frameTime, spawnBudgetPerFrame);
+        updateEntities(manager, systems, input, frameTime);
+
+        // Quantize the world once, then filter and delta encode per client
+        worldSnapshot.tick = tick;
+        makeSnapshotFromEntities(
+                getEntitesForSystem(manager, makeDataFromEntitiesBitset),
+                getEntitesForSystem(manager, addBulletToShapeDataBitset),
+                manager, worldSnapshot);
+
+        for(auto& client : clients)
+        {
+            filterSnapshot(worldSnapshot, client->viewX, client->viewY, client->viewRadius, clientSnapshot);
+
+            const Snapshot& acked = client->history[client->ackTick % snapshotHistorySize];
+            const Snapshot* baseline = client->ackTick != 0 && acked.tick == client->ackTick ? &acked : nullptr;
+
+            encodeSnapshot(clientSnapshot, baseline, message);
+            sendFragmented(message, tick, [&](const uint8_t* data, std::size_t size)
+            {
+                socket.send(client->address, data, size);
+                client->bytesSent += size;
+            });
+
+            std::swap(client->history[tick % snapshotHistorySize], clientSnapshot);
+        }
+
+        tickCost += ClockType::now() - tickStart;
+
+        publishMetrics(metrics, manager, sinceMetrics, frameTime);
+
+        // Report once a second
+        if(tick % 60 == 0)
+        {
+            std::cout << "tick " << tick << ": " << manager.componentBitsets.size() << " entities, "
+                << std::chrono::duration_cast<TimeRes>(tickCost).count() / 60 << " us/tick, "
+                << clients.size() << " clients";
+
+            for(auto& client : clients)
+            {
+                std::cout << ", " << client->address.port << ": " << client->bytesSent / 1024 << " KiB/s";
+                client->bytesSent = 0;
+            }
+            std::cout << std::endl;
 
-        auto& moveSysEntities = getEntitesForSystem(manager, moveBitset);
-        moveEntities(moveSysEntities, manager, frameTime);
+            tickCost = {};
+        }
+    }
 
-        auto& rotateSysEntities = getEntitesForSystem(manager, rotateBitset);
-        rotateEntites(rotateSysEntities, manager, frameTime);
+    return 0;
+}
 
-        auto& controllerSysEntites = getEntitesForSystem(manager, controlMoveBitset);
-        controllEnities(controllerSysEntites, manager, keymap, frameTime);
+// Thin client that renders the snapshots streamed from a server
+int runClient(const char* serverIp, uint16_t port, float viewRadius, const char* captureTarget, int captureEvery)
+{
+    UdpSocket socket;
+    if(!socket.open())
+    {
+        std::cerr << "Could not open a UDP socket" << std::endl;
+        return 1;
+    }
 
-        auto& invisibleControllSysEntities = getEntitesForSystem(manager, invisibleControllBitset);
-        showInvisibleEntities(invisibleControllSysEntities, manager, keymap);
+    const NetAddress server = makeNetAddress(serverIp, port);
 
-        auto& canFireSysEntities = getEntitesForSystem(manager, canFireBitset);
-        fireingEntities(canFireSysEntities, manager, keymap);
+    renderer::init("dod_test client", windowWidth, windowHeight);
+
+    FrameCapture capture;
+    openCapture(capture, captureTarget, captureEvery);
+
+    using TimeRes = std::chrono::microseconds;
+
+    InputCollector input;
+
+    // Decoded snapshots indexed by tick % snapshotHistorySize, used as delta baselines
+    std::array<Snapshot, snapshotHistorySize> history;
+    uint32_t latestTick = 0;
+    FragmentAssembler assembler = {};
+
+    std::size_t bytesReceived = 0;
+    uint32_t frame = 0;
+    uint8_t packet[2048];
+    std::vector<uint8_t> ack;
+
+    std::vector<float> shapeData;
+    std::vector<ShapeDrawInfo> drawInfo;
+
+    while(!input.quit)
+    {
+        limitFps<TimeRes, 60>([&](TimeRes duration) { waitForInput(input, duration); });
+        pollInput(input);
+        input.pending.clear();
+
+        NetAddress from;
+        while(std::size_t size = socket.receive(from, packet, sizeof(packet)))
+        {
+            bytesReceived += size;
+
+            if(!(from == server) || !addFragment(assembler, packet, size))
+                continue;
+
+            const uint8_t* data = assembler.message.data();
+            const std::size_t dataSize = assembler.message.size();
+
+            uint32_t baselineTick = snapshotBaselineTick(data, dataSize);
+            const Snapshot& stored = history[baselineTick % snapshotHistorySize];
+            if(baselineTick != 0 && stored.tick != baselineTick)
+                continue;
+
+            Snapshot decoded;
+            if(!decodeSnapshot(data, dataSize, baselineTick != 0 ? &stored : nullptr, decoded) || decoded.tick <= latestTick)
+                continue;
+
+            latestTick = decoded.tick;
+            history[latestTick % snapshotHistorySize] = std::move(decoded);
+        }
+
+        const Snapshot& latest = history[latestTick % snapshotHistorySize];
+
+        // Center the interest area on our ship when we can see it
+        float viewX = windowWidth / 2.0f, viewY = windowHeight / 2.0f;
+        for(auto& ent : latest.entities)
+            if(ent.shape == (uint8_t)ShapeDef::SHIP)
+            {
+                viewX = dequantizePos(ent.x);
+                viewY = dequantizePos(ent.y);
+                break;
+            }
+
+        uint8_t keys = 0;
+        for(std::size_t k = 0; k < std::size(netKeys); k++)
+            if(isKeyDown(input.keys, netKeys[k]))
+                keys |= 1 << k;
+
+        ack.clear();
+        ByteWriter w{ack};
+        w.u8(netAckPacket);
+        w.u32(latestTick);
+        w.u16(quantizePos(viewX));
+        w.u16(quantizePos(viewY));
+        w.u16((uint16_t)viewRadius);
+        w.u8(keys);
+        socket.send(server, ack.data(), ack.size());
+
+        if(++frame % 60 == 0)
+        {
+            std::cout << "tick " << latestTick << ": " << latest.entities.size() << " entities, "
+                << bytesReceived / 1024 << " KiB/s" << std::endl;
+            bytesReceived = 0;
+        }
 
-        // Transform data
         shapeData.clear();
         drawInfo.clear();
 
-        auto& makeDataFromEntitesSysEntities = getEntitesForSystem(manager, makeDataFromEntitiesBitset);
-        makeShapeDataFromEntities(makeDataFromEntitesSysEntities, manager, shapeData, drawInfo);
-
+        makeShapeDataFromSnapshot(latest, shapeData, drawInfo);
         transformShapes(shapeData, drawInfo);
+        addSnapshotBulletsToShapeData(latest, shapeData, drawInfo);
+
+        renderer::clear();
+        renderShapes(shapeData, drawInfo);
+        capture.capture(renderer::readPixels);
+        renderer::show();
+    }
+
+    finishCapture(capture);
+    renderer::quit();
+
+    return 0;
+}
+
+// WORLDS
+
+// Particle buffers are allocated once at full capacity, emitting past it drops particles. A dense
+// field being shot up keeps well over 100K explosion particles alive.
+constexpr std::size_t exhaustParticleCapacity = 1 << 14;
+constexpr std::size_t explosionParticleCapacity = 1 << 17;
+
+// Everything one game instance owns. Worlds share nothing they write, so any number of them can be
+// stepped side by side, as long as each stays on one thread: behavior frames come from the pool of
+// the thread that made them and have to be freed there.
+struct World
+{
+    EntityManager manager;
+    SystemState systems;
+    SceneSpawner spawner;
+    CounterRandom random;
+    FrameInput input;
+
+    // Transformed shapes of this step, collisions are tested against them. The last step is kept to
+    // reuse the vertices of unchanged entities.
+    std::vector<float> shapeData;
+    std::vector<float> lastShapeData;
+    std::vector<ShapeDrawInfo> drawInfo;
+    ChangeQuery shapeQuery;
+
+    CollisionState collisions;
+    ParticleBuffer explosionParticles;      // A capacity of 0 skips the effect
+
+    RasterImage observation;                // What the world looked like at its last renderWorld
+};
+
+void initWorld(World& world, const Scene& scene, uint64_t seed, std::size_t explosionParticles)
+{
+    world.random = {seed, 0};
+    world.spawner.scene = scene;
+    startScene(world.spawner, world.manager);
+    initParticles(world.explosionParticles, explosionParticles, 0xC0C0C0FF, (uint32_t)seed);
+}
+
+// Simulate one step with the input in world.input
+void stepWorld(World& world, float ft)
+{
+    static const auto makeDataFromEntitiesBitset = getMakeShapeDataFromEntitiesBitset();
+    static const auto addBulletToShapeDataBitset = getAddBulletsToShapeDataBitset();
+    static const auto collideBulletsBitset = getCollideBulletsBitset();
+
+    EntityManager& manager = world.manager;
+
+    spawnSceneWaves(world.spawner, manager, world.systems.player, world.random, ft, spawnBudgetPerFrame);
+    updateEntities(manager, world.systems, world.input, ft);
+    updateParticles(world.explosionParticles, ft, windowWidth, windowHeight);
+
+    // Transform data
+    std::swap(world.shapeData, world.lastShapeData);
+    world.shapeData.clear();
+    world.drawInfo.clear();
+
+    auto& makeDataFromEntitesSysEntities = getEntitesForSystem(manager, makeDataFromEntitiesBitset);
+    auto& changedShapeEntities = getChangedEntities(manager, makeDataFromEntitesSysEntities, makeDataFromEntitiesBitset, world.shapeQuery);
+    makeShapeDataFromEntities(makeDataFromEntitesSysEntities, changedShapeEntities, manager, world.lastShapeData, world.shapeData, world.drawInfo);
+
+    transformShapes(world.shapeData, world.drawInfo);
+
+    auto& addBulletToShapeDataSysEntities = getEntitesForSystem(manager, addBulletToShapeDataBitset);
+    addBulletsToShapeData(addBulletToShapeDataSysEntities, manager, world.shapeData, world.drawInfo);
+
+    // Collision handling, against the vertices transformed above
+    auto& collideBulletsSysEntities = getEntitesForSystem(manager, collideBulletsBitset);
+    collideBullets(collideBulletsSysEntities, makeDataFromEntitesSysEntities, manager, world.shapeData, world.collisions, ft);
+    destroyAstroids(world.collisions.hits, manager, world.random, world.explosionParticles);
+}
+
+
+// BATCH SIMULATION
+constexpr float batchFrameTime = 1.0f / 60.0f;
+
+// Counter stream of the random player, after the spawn streams
+constexpr uint32_t playerInputStream = 3;
+
+// Stand in for an automated player: every step each key flips with a chance of 1 in 8. The
+// choices come from the world's own counter stream, indexed by step, so a world plays the same
+// whichever thread steps it.
+void randomPlayerInput(World& world, uint64_t step)
+{
+    const philox::Block choices = randomBlock(world.random, step, playerInputStream);
+
+    world.input.events.clear();
+    for(std::size_t k = 0; k < std::size(netKeys); k++)
+        if(choices[k] < UINT32_MAX / 8)
+            setFrameKey(world.input, netKeys[k], !isKeyDown(world.input.keys, netKeys[k]));
+}
+
+// FNV-1a over the positions and the last observation, to compare runs
+uint64_t worldChecksum(const World& world)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    auto add = [&](const void* data, std::size_t size)
+    {
+        for(std::size_t i = 0; i < size; i++)
+            hash = (hash ^ ((const uint8_t*)data)[i]) * 0x100000001B3ull;
+    };
+
+    const std::size_t count = world.manager.componentBitsets.size();
+    add(&count, sizeof(count));
+    add(world.manager.posList.data(), count * sizeof(CPosition));
+    add(world.observation.pixels.data(), world.observation.pixels.size());
+    return hash;
+}
+
+// Draw the last step of a world into its observation, without a window. The renderer is a single
+// window, so batch worlds draw in software instead.
+void renderWorld(World& world)
+{
+    if(world.observation.pixels.empty())
+        initRaster(world.observation, windowWidth, windowHeight);
+
+    clearRaster(world.observation);
+    rasterizeShapes(world.observation, world.shapeData, world.drawInfo);
+
+    auto& particles = world.explosionParticles;
+    drawRasterPoints(world.observation, particles.x.data(), particles.y.data(), particles.count, particles.color);
+}
+
+// Step worldCount worlds in lockstep for stepCount fixed steps on threadCount threads. With a
+// renderEvery above 0 every world is rendered into its observation every renderEvery steps.
+// Thread t owns worlds t, t + threadCount, ... from creation to destruction. World w is seeded
+// with w, so the outcome doesn't depend on the thread count.
+int runBatch(const Scene& scene, std::size_t worldCount, std::size_t stepCount, std::size_t threadCount,
+        std::size_t renderEvery)
+{
+    using ClockType = std::chrono::steady_clock;
+
+    threadCount = std::max<std::size_t>(1, std::min(threadCount, worldCount));
+
+    std::vector<uint64_t> checksums(worldCount);
+    std::vector<std::size_t> entityCounts(worldCount);
+    std::barrier lockstep(threadCount);
+    ClockType::time_point start, end;
+
+    auto runWorlds = [&](std::size_t thread)
+    {
+        std::vector<std::unique_ptr<World>> worlds;
+        for(std::size_t w = thread; w < worldCount; w += threadCount)
+        {
+            worlds.emplace_back(new World);
+            initWorld(*worlds.back(), scene, w, 0);
+        }
+
+        lockstep.arrive_and_wait();
+        if(thread == 0)
+            start = ClockType::now();
+
+        for(std::size_t step = 0; step < stepCount; step++)
+        {
+            for(auto& world : worlds)
+            {
+                randomPlayerInput(*world, step);
+                stepWorld(*world, batchFrameTime);
+                if(renderEvery > 0 && (step + 1) % renderEvery == 0)
+                    renderWorld(*world);
+            }
+            lockstep.arrive_and_wait();
+        }
+
+        if(thread == 0)
+            end = ClockType::now();
+
+        for(std::size_t i = 0; i < worlds.size(); i++)
+        {
+            checksums[thread + i * threadCount] = worldChecksum(*worlds[i]);
+            entityCounts[thread + i * threadCount] = worlds[i]->manager.componentBitsets.size();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(std::size_t t = 1; t < threadCount; t++)
+        threads.emplace_back(runWorlds, t);
+    runWorlds(0);
+    for(auto& thread : threads)
+        thread.join();
+
+    uint64_t checksum = 0;
+    std::size_t entities = 0;
+    for(std::size_t w = 0; w < worldCount; w++)
+    {
+        checksum = checksum * 31 + checksums[w];
+        entities += entityCounts[w];
+    }
+
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << worldCount << " worlds x " << stepCount << " steps on " << threadCount << " threads";
+    if(renderEvery > 0)
+        std::cout << ", rendered every " << renderEvery << " steps";
+    std::cout << ": "
+        << seconds << " s, " << (worldCount * stepCount) / std::max(seconds, 1e-9) << " world steps/s, "
+        << entities << " entities at the end, checksum " << std::hex << checksum << std::dec << std::endl;
+
+    return 0;
+}
+
+// Remove "name value" from the arguments and return the value, or nullptr when it isn't there
+const char* takeOption(int& argc, char** argv, const char* name)
+{
+    for(int i = 1; i + 1 < argc; i++)
+    {
+        if(std::string(argv[i]) != name)
+            continue;
+
+        const char* value = argv[i + 1];
+        std::copy(argv + i + 2, argv + argc, argv + i);
+        argc -= 2;
+        return value;
+    }
 
-        auto& addBulletToShapeDataSysEntities = getEntitesForSystem(manager, addBulletToShapeDataBitset);
-        addBulletsToShapeData(addBulletToShapeDataSysEntities, manager, shapeData, drawInfo);
+    return nullptr;
+}
+
+int main(int argc, char** argv)
+{
+    // astroids [--scene file]
+    // astroids --compile-scene text_file binary_file
+    // astroids --server [port] [astroids | scene file]
+    // astroids --client [ip] [port] [view radius]
+    // astroids --batch [worlds] [steps] [threads] [scene file]
+    //
+    // Any of them can add --metrics file or --metrics unix:socket_path. The game and the client
+    // can add --capture file.y4m or --capture path_prefix for PNGs, and --capture-every n. The
+    // batch can add --render-every n to draw every world offscreen every n steps.
+    const char* metricsTarget = takeOption(argc, argv, "--metrics");
+    const char* captureTarget = takeOption(argc, argv, "--capture");
+    const char* captureEveryOption = takeOption(argc, argv, "--capture-every");
+    const char* renderEveryOption = takeOption(argc, argv, "--render-every");
+
+    const std::string mode = argc > 1 ? argv[1] : "";
+
+    int captureEvery = 1;
+    if(captureEveryOption && !parseCount(captureEveryOption, captureEvery))
+    {
+        std::cerr << "Usage: --capture-every n, n above zero" << std::endl;
+        return 1;
+    }
+
+    if((captureTarget || captureEveryOption) && (mode == "--server" || mode == "--batch" || mode == "--compile-scene"))
+    {
+        std::cerr << "--capture only applies to the game and --client" << std::endl;
+        return 1;
+    }
+
+    if(renderEveryOption && mode != "--batch")
+    {
+        std::cerr << "--render-every only applies to --batch" << std::endl;
+        return 1;
+    }
+
+    Scene scene = makeDefaultScene(29);
+
+    if(mode == "--compile-scene")
+        return argc > 3 && compileScene(argv[2], argv[3]) ? 0 : 1;
+
+    if(mode == "--scene" && (argc < 3 || !loadScene(argv[2], scene)))
+        return 1;
 
-        // Collision handling
+    if(mode == "--server")
+    {
+        // The last argument is either a plain astroid count or a scene file
+        char* end = nullptr;
+        std::size_t astroidCount = argc > 3 ? std::strtoul(argv[3], &end, 10) : 29;
+
+        if(argc > 3 && *end != '\0' && !loadScene(argv[3], scene))
+            return 1;
+        if(argc > 3 && *end == '\0')
+            scene = makeDefaultScene(astroidCount);
+
+        return runServer(argc > 2 ? std::atoi(argv[2]) : defaultServerPort, scene, metricsTarget);
+    }
+
+    if(mode == "--batch")
+    {
+        std::size_t worldCount = 256, stepCount = 600;
+        std::size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+        std::size_t renderEvery = 0;
+        if((argc > 2 && !parseCount(argv[2], worldCount)) || (argc > 3 && !parseCount(argv[3], stepCount)) ||
+                (argc > 4 && !parseCount(argv[4], threadCount)) ||
+                (renderEveryOption && !parseCount(renderEveryOption, renderEvery)))
+        {
+            std::cerr << "Usage: astroids --batch [worlds] [steps] [threads] [scene file] [--render-every n], "
+                "counts above zero" << std::endl;
+            return 1;
+        }
+
+        if(argc > 5 && !loadScene(argv[5], scene))
+            return 1;
+
+        return runBatch(scene, worldCount, stepCount, threadCount, renderEvery);
+    }
+
+    if(mode == "--client")
+        return runClient(argc > 2 ? argv[2] : "127.0.0.1", argc > 3 ? std::atoi(argv[3]) : defaultServerPort,
+                argc > 4 ? std::atof(argv[4]) : 0.0f, captureTarget, captureEvery);
+
+    renderer::init("dod_test", windowWidth, windowHeight);
+
+    std::random_device rd;
+
+    using TimeRes = std::chrono::microseconds;
+
+    InputCollector input;
+
+    World world;
+    initWorld(world, scene, (uint64_t)rd() << 32 | rd(), explosionParticleCapacity);
+    world.systems.behaviors.workers.start(defaultBehaviorThreads());
+
+    EntityManager& manager = world.manager;
+
+    // Set up bitsets
+    auto emitExhaustBitset = getEmitExhaustBitset();
+
+    // Particle effects
+    ParticleBuffer exhaustParticles;
+    initParticles(exhaustParticles, exhaustParticleCapacity, 0xFF8000FF, rd());
+    ParticleBuffer& explosionParticles = world.explosionParticles;
+    std::vector<float> particlePoints;
+
+    std::vector<float>& shapeData = world.shapeData;
+    std::vector<ShapeDrawInfo>& drawInfo = world.drawInfo;
+
+    enum HudLabel { HUD_ENTITIES, HUD_FPS };
+    TextBatch hud;
+
+    MetricsPublisher metrics;
+    float sinceMetrics = 0.0f;
+    if(metricsTarget && !metrics.open(metricsTarget))
+        std::cerr << "Could not open metrics target " << metricsTarget << std::endl;
+
+    FrameCapture capture;
+    openCapture(capture, captureTarget, captureEvery);
+
+    while(!input.quit)
+    {
+        // Timing, input is taken while waiting for the frame
+        auto ticks = limitFps<TimeRes, 60>([&](TimeRes duration) { waitForInput(input, duration); });
+        float frameTime = ticks / 1000000.0f;
+        observe(manager.metrics.frameTimes, frameTime);
+
+        // Input
+        pollInput(input);
+        takeFrameInput(input, world.input, frameTime);
+
+        // Update, transform and collide
+        stepWorld(world, frameTime);
+
+        updateParticles(exhaustParticles, frameTime, windowWidth, windowHeight);
+
+        auto& emitExhaustSysEntities = getEntitesForSystem(manager, emitExhaustBitset);
+        emitExhaust(emitExhaustSysEntities, manager, exhaustParticles, frameTime);
+
+        // HUD, labels are only laid out again when their text changes
+        char hudText[32];
+        std::snprintf(hudText, sizeof(hudText), "%zu ENTITIES", manager.componentBitsets.size());
+        setLabel(hud, HUD_ENTITIES, hudText, 8.0f, 8.0f, 12.0f, 0x808080FF);
+        std::snprintf(hudText, sizeof(hudText), "%d FPS", frameTime > 0.0f ? (int)(1.0f / frameTime + 0.5f) : 0);
+        setLabel(hud, HUD_FPS, hudText, 8.0f, 28.0f, 12.0f, 0x808080FF);
+
+        addTextToShapeData(hud, shapeData, drawInfo);
 
         //Rendering
         renderer::clear();
 
         renderShapes(shapeData, drawInfo);
 
+        makeParticlePoints(exhaustParticles, particlePoints);
+        renderer::drawPoints(particlePoints.data(), exhaustParticles.count, exhaustParticles.color);
+
+        makeParticlePoints(explosionParticles, particlePoints);
+        renderer::drawPoints(particlePoints.data(), explosionParticles.count, explosionParticles.color);
+
+        capture.capture(renderer::readPixels);
         renderer::show();
-    }
 
+        publishMetrics(metrics, manager, sinceMetrics, frameTime);
+    }
 
+    finishCapture(capture);
     renderer::quit();
 
     return 0;
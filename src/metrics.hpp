@@ -0,0 +1,212 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Runtime metrics in the Prometheus text exposition format.
+//
+// Hot paths only bump plain counters, the text is built when it is published every few
+// seconds. A target is either a file, which is replaced atomically so a textfile collector
+// never sees half of it, or "unix:/some/path", a local socket that hands the current text to
+// every client that connects, like a scrape endpoint.
+
+struct MetricHistogram
+{
+    std::vector<double> bounds;     // Upper bounds of the buckets, ascending, +Inf is implied
+    std::vector<uint64_t> counts;   // One per bound plus the +Inf bucket, not cumulative
+    double sum;
+    uint64_t count;
+};
+
+MetricHistogram makeHistogram(std::vector<double> bounds)
+{
+    MetricHistogram histogram;
+    histogram.counts.assign(bounds.size() + 1, 0);
+    histogram.bounds = std::move(bounds);
+    histogram.sum = 0.0;
+    histogram.count = 0;
+    return histogram;
+}
+
+inline void observe(MetricHistogram& histogram, double value)
+{
+    std::size_t bucket = 0;
+    while(bucket < histogram.bounds.size() && value > histogram.bounds[bucket])
+        bucket++;
+
+    histogram.counts[bucket]++;
+    histogram.sum += value;
+    histogram.count++;
+}
+
+// Text encoding
+void writeMetricHeader(std::string& out, const char* name, const char* type, const char* help)
+{
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+// labels is the part between the braces, like: archetype="a+b"
+void writeMetricSample(std::string& out, const char* name, double value, const char* labels = nullptr)
+{
+    char number[32];
+    std::snprintf(number, sizeof(number), "%.17g", value);
+
+    out += name;
+    if(labels && labels[0] != '\0')
+    {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += number;
+    out += '\n';
+}
+
+void writeMetric(std::string& out, const char* name, const char* type, const char* help, double value)
+{
+    writeMetricHeader(out, name, type, help);
+    writeMetricSample(out, name, value);
+}
+
+void writeHistogram(std::string& out, const char* name, const char* help, const MetricHistogram& histogram)
+{
+    writeMetricHeader(out, name, "histogram", help);
+
+    const std::string bucketName = std::string(name) + "_bucket";
+    char labels[64];
+    uint64_t cumulative = 0;
+
+    for(std::size_t b = 0; b < histogram.bounds.size(); b++)
+    {
+        cumulative += histogram.counts[b];
+        std::snprintf(labels, sizeof(labels), "le=\"%g\"", histogram.bounds[b]);
+        writeMetricSample(out, bucketName.c_str(), cumulative, labels);
+    }
+    writeMetricSample(out, bucketName.c_str(), histogram.count, "le=\"+Inf\"");
+
+    writeMetricSample(out, (std::string(name) + "_sum").c_str(), histogram.sum);
+    writeMetricSample(out, (std::string(name) + "_count").c_str(), histogram.count);
+}
+
+
+class MetricsPublisher
+{
+public:
+    MetricsPublisher() = default;
+    MetricsPublisher(const MetricsPublisher&) = delete;
+    MetricsPublisher& operator=(const MetricsPublisher&) = delete;
+
+    ~MetricsPublisher()
+    {
+        close();
+    }
+
+    // target is a file path or "unix:" followed by a socket path
+    bool open(const std::string& target)
+    {
+        close();
+
+        if(target.compare(0, 5, "unix:") != 0)
+        {
+            _path = target;
+            return !_path.empty();
+        }
+
+        _path = target.substr(5);
+
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if(_path.empty() || _path.size() >= sizeof(addr.sun_path))
+            return false;
+        std::memcpy(addr.sun_path, _path.c_str(), _path.size() + 1);
+
+        _listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if(_listener < 0)
+            return false;
+
+        // A socket file left behind by an earlier run would make bind fail
+        ::unlink(_path.c_str());
+
+        if(::bind(_listener, (const sockaddr*)&addr, sizeof(addr)) < 0 ||
+                ::listen(_listener, 8) < 0 ||
+                ::fcntl(_listener, F_SETFL, O_NONBLOCK) < 0)
+        {
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    void close()
+    {
+        if(_listener >= 0)
+        {
+            ::close(_listener);
+            ::unlink(_path.c_str());
+        }
+        _listener = -1;
+        _path.clear();
+    }
+
+    bool isOpen() const
+    {
+        return !_path.empty();
+    }
+
+    // Replace the file, or answer every client waiting on the socket
+    bool publish(const std::string& text)
+    {
+        if(_listener < 0)
+        {
+            const std::string tmpPath = _path + ".tmp";
+            std::FILE* file = std::fopen(tmpPath.c_str(), "wb");
+            if(!file)
+                return false;
+
+            const bool written = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+            return std::fclose(file) == 0 && written && std::rename(tmpPath.c_str(), _path.c_str()) == 0;
+        }
+
+        int client;
+        while((client = ::accept(_listener, nullptr, nullptr)) >= 0)
+        {
+            std::size_t sent = 0;
+            while(sent < text.size())
+            {
+                ssize_t n = ::send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+                if(n <= 0)
+                    break;
+                sent += n;
+            }
+            ::close(client);
+        }
+
+        return true;
+    }
+
+private:
+    std::string _path;
+    int _listener = -1;
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef NET_HPP
+#define NET_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Minimal non blocking UDP socket over IPv4
+
+struct NetAddress
+{
+    uint32_t ip;    // Host byte order
+    uint16_t port;  // Host byte order
+
+    bool operator==(const NetAddress& other) const
+    {
+        return ip == other.ip && port == other.port;
+    }
+};
+
+inline NetAddress makeNetAddress(const char* ip, uint16_t port)
+{
+    in_addr addr;
+    if(inet_pton(AF_INET, ip, &addr) != 1)
+        addr.s_addr = htonl(INADDR_LOOPBACK);
+    return {ntohl(addr.s_addr), port};
+}
+
+class UdpSocket
+{
+public:
+    UdpSocket() = default;
+    UdpSocket(const UdpSocket&) = delete;
+    UdpSocket& operator=(const UdpSocket&) = delete;
+
+    ~UdpSocket()
+    {
+        close();
+    }
+
+    // Open the socket and bind it to port on all interfaces, port 0 picks any free port
+    bool open(uint16_t port = 0)
+    {
+        close();
+
+        _handle = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if(_handle < 0)
+            return false;
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+
+        if(::bind(_handle, (const sockaddr*)&addr, sizeof(addr)) < 0 ||
+                ::fcntl(_handle, F_SETFL, O_NONBLOCK) < 0)
+        {
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    void close()
+    {
+        if(_handle >= 0)
+            ::close(_handle);
+        _handle = -1;
+    }
+
+    bool isOpen() const
+    {
+        return _handle >= 0;
+    }
+
+    bool send(const NetAddress& to, const void* data, std::size_t size)
+    {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(to.ip);
+        addr.sin_port = htons(to.port);
+
+        return ::sendto(_handle, data, size, 0, (const sockaddr*)&addr, sizeof(addr)) == (ssize_t)size;
+    }
+
+    // Returns the number of bytes received, 0 when there is nothing to read
+    std::size_t receive(NetAddress& from, void* data, std::size_t size)
+    {
+        sockaddr_in addr = {};
+        socklen_t addrLen = sizeof(addr);
+
+        ssize_t received = ::recvfrom(_handle, data, size, 0, (sockaddr*)&addr, &addrLen);
+        if(received <= 0)
+            return 0;
+
+        from = {ntohl(addr.sin_addr.s_addr), ntohs(addr.sin_port)};
+        return (std::size_t)received;
+    }
+
+private:
+    int _handle = -1;
+};
+
+#endif
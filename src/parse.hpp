@@ -0,0 +1,29 @@
+#ifndef PARSE_HPP
+#define PARSE_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <limits>
+
+// Number parsing for command line arguments and scene files, strict about what it accepts
+
+// A count in [1, max], plain decimal digits with nothing before or after. Unlike strtoul this
+// rejects a sign, leading spaces and trailing garbage instead of wrapping or stopping early.
+template<typename T>
+bool parseCount(const char* text, T& value, T max = std::numeric_limits<T>::max())
+{
+    if(*text < '0' || *text > '9')
+        return false;
+
+    char* end;
+    errno = 0;
+    const unsigned long long parsed = std::strtoull(text, &end, 10);
+    if(*end != '\0' || errno == ERANGE || parsed == 0 || parsed > max)
+        return false;
+
+    value = (T)parsed;
+    return true;
+}
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef PARTICLES_HPP
+#define PARTICLES_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "fastmath.hpp"
+
+// Particles live outside of the EntityManager. Every buffer is a set of parallel arrays
+// allocated once at its full capacity, the first count elements are alive.
+struct ParticleBuffer
+{
+    std::vector<float> x, y;
+    std::vector<float> xVel, yVel;
+    std::vector<float> life;
+
+    std::size_t count;
+    uint32_t color;
+    uint32_t seed;
+};
+
+void initParticles(ParticleBuffer& buffer, std::size_t capacity, uint32_t color, uint32_t seed = 0x9E3779B9)
+{
+    buffer.x.assign(capacity, 0.0f);
+    buffer.y.assign(capacity, 0.0f);
+    buffer.xVel.assign(capacity, 0.0f);
+    buffer.yVel.assign(capacity, 0.0f);
+    buffer.life.assign(capacity, 0.0f);
+
+    buffer.count = 0;
+    buffer.color = color;
+    buffer.seed = seed != 0 ? seed : 1;
+}
+
+// xorshift32 mapped to [0, 1), good enough for visual noise and much cheaper than mt19937
+inline float particleRandom(uint32_t& seed)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return (seed >> 8) * (1.0f / 16777216.0f);
+}
+
+// Emit up to count particles from (x, y) in a cone of +-spread radians around dir.
+// Particles that don't fit in the buffer are dropped.
+void emitParticles(ParticleBuffer& buffer, std::size_t count, float x, float y,
+        float dir, float spread, float minSpeed, float maxSpeed, float minLife, float maxLife)
+{
+    const std::size_t first = buffer.count;
+    count = std::min(count, buffer.x.size() - first);
+
+    float* xs = buffer.x.data() + first;
+    float* ys = buffer.y.data() + first;
+    float* xVels = buffer.xVel.data() + first;
+    float* yVels = buffer.yVel.data() + first;
+    float* lifes = buffer.life.data() + first;
+
+    // The angles are written to xVel and turned into a direction in place, sinCos loads
+    // each angle before it stores to the same slot.
+    for(std::size_t i = 0; i < count; i++)
+    {
+        xs[i] = x;
+        ys[i] = y;
+        xVels[i] = dir + spread * (particleRandom(buffer.seed) * 2.0f - 1.0f);
+        lifes[i] = minLife + (maxLife - minLife) * particleRandom(buffer.seed);
+    }
+
+    fastmath::sinCos(xVels, yVels, xVels, count);
+
+    for(std::size_t i = 0; i < count; i++)
+    {
+        float speed = minSpeed + (maxSpeed - minSpeed) * particleRandom(buffer.seed);
+        xVels[i] *= speed;
+        yVels[i] *= speed;
+    }
+
+    buffer.count += count;
+}
+
+// Move and age every live particle, then compact the dead ones away keeping emission order
+void updateParticles(ParticleBuffer& buffer, float ft, float width, float height)
+{
+    float* xs = buffer.x.data();
+    float* ys = buffer.y.data();
+    float* xVels = buffer.xVel.data();
+    float* yVels = buffer.yVel.data();
+    float* lifes = buffer.life.data();
+    const std::size_t count = buffer.count;
+
+    std::size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128 vFt = _mm_set1_ps(ft);
+    const __m128 vWidth = _mm_set1_ps(width);
+    const __m128 vHeight = _mm_set1_ps(height);
+    const __m128 vZero = _mm_setzero_ps();
+
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128 px = _mm_add_ps(_mm_loadu_ps(xs + i), _mm_mul_ps(_mm_loadu_ps(xVels + i), vFt));
+        __m128 py = _mm_add_ps(_mm_loadu_ps(ys + i), _mm_mul_ps(_mm_loadu_ps(yVels + i), vFt));
+
+        // Wrap around the window edges
+        px = _mm_add_ps(px, _mm_and_ps(_mm_cmplt_ps(px, vZero), vWidth));
+        px = _mm_sub_ps(px, _mm_and_ps(_mm_cmpgt_ps(px, vWidth), vWidth));
+        py = _mm_add_ps(py, _mm_and_ps(_mm_cmplt_ps(py, vZero), vHeight));
+        py = _mm_sub_ps(py, _mm_and_ps(_mm_cmpgt_ps(py, vHeight), vHeight));
+
+        _mm_storeu_ps(xs + i, px);
+        _mm_storeu_ps(ys + i, py);
+        _mm_storeu_ps(lifes + i, _mm_sub_ps(_mm_loadu_ps(lifes + i), vFt));
+    }
+#endif
+
+    for(; i < count; i++)
+    {
+        xs[i] += xVels[i] * ft;
+        ys[i] += yVels[i] * ft;
+
+        if(xs[i] < 0.0f)
+            xs[i] += width;
+        else if(xs[i] > width)
+            xs[i] -= width;
+
+        if(ys[i] < 0.0f)
+            ys[i] += height;
+        else if(ys[i] > height)
+            ys[i] -= height;
+
+        lifes[i] -= ft;
+    }
+
+    std::size_t alive = 0;
+    for(std::size_t j = 0; j < count; j++)
+    {
+        if(lifes[j] <= 0.0f)
+            continue;
+
+        xs[alive] = xs[j];
+        ys[alive] = ys[j];
+        xVels[alive] = xVels[j];
+        yVels[alive] = yVels[j];
+        lifes[alive] = lifes[j];
+        alive++;
+    }
+
+    buffer.count = alive;
+}
+
+// Interleave the live positions as x,y pairs for a single point batch
+void makeParticlePoints(const ParticleBuffer& buffer, std::vector<float>& points)
+{
+    points.resize(buffer.count * 2);
+
+    for(std::size_t i = 0; i < buffer.count; i++)
+    {
+        points[i*2] = buffer.x[i];
+        points[i*2+1] = buffer.y[i];
+    }
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef RANDOM_HPP
+#define RANDOM_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Counter based random numbers (Philox4x32-10, Salmon et al. 2011).
+//
+// A block of four 32 bit words is a pure function of a 64 bit seed and a 128 bit counter, here
+// an index and a stream number. Nothing is carried from one number to the next, so the numbers
+// of an entity don't depend on which thread made them or in what order, and many blocks can be
+// computed side by side. Output matches the Random123 reference implementation.
+
+namespace philox
+{
+    constexpr uint32_t m0 = 0xD2511F53;
+    constexpr uint32_t m1 = 0xCD9E8D57;
+    constexpr uint32_t w0 = 0x9E3779B9;     // Key schedule
+    constexpr uint32_t w1 = 0xBB67AE85;
+    constexpr int rounds = 10;
+
+    using Block = std::array<uint32_t, 4>;
+
+    inline Block block(Block c, uint32_t k0, uint32_t k1)
+    {
+        for(int r = 0; r < rounds; r++)
+        {
+            const uint64_t p0 = (uint64_t)m0 * c[0];
+            const uint64_t p1 = (uint64_t)m1 * c[2];
+            c = {(uint32_t)(p1 >> 32) ^ c[1] ^ k0, (uint32_t)p1, (uint32_t)(p0 >> 32) ^ c[3] ^ k1, (uint32_t)p0};
+            k0 += w0;
+            k1 += w1;
+        }
+        return c;
+    }
+
+#if defined(__SSE2__)
+    // Low and high halves of a * m for four lanes, SSE2 only multiplies the even lanes at once
+    inline void mulHiLo4(__m128i a, __m128i m, __m128i& lo, __m128i& hi)
+    {
+        const __m128i lowHalves = _mm_set_epi32(0, -1, 0, -1);
+        const __m128i even = _mm_mul_epu32(a, m);
+        const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), m);
+        lo = _mm_or_si128(_mm_and_si128(even, lowHalves), _mm_slli_epi64(odd, 32));
+        hi = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_andnot_si128(lowHalves, odd));
+    }
+
+    // Four blocks, word w of every block in c[w]
+    inline void block4(__m128i c[4], uint32_t k0, uint32_t k1)
+    {
+        const __m128i vm0 = _mm_set1_epi32(m0);
+        const __m128i vm1 = _mm_set1_epi32(m1);
+
+        __m128i lo0, hi0, lo1, hi1;
+        for(int r = 0; r < rounds; r++)
+        {
+            mulHiLo4(c[0], vm0, lo0, hi0);
+            mulHiLo4(c[2], vm1, lo1, hi1);
+            c[0] = _mm_xor_si128(_mm_xor_si128(hi1, c[1]), _mm_set1_epi32(k0));
+            c[1] = lo1;
+            c[2] = _mm_xor_si128(_mm_xor_si128(hi0, c[3]), _mm_set1_epi32(k1));
+            c[3] = lo0;
+            k0 += w0;
+            k1 += w1;
+        }
+    }
+#endif
+}
+
+// A seed and the next unused index. Every entity takes an index and draws all of its numbers from
+// blocks at that index, one stream per block it needs.
+struct CounterRandom
+{
+    uint64_t seed;
+    uint64_t next;
+};
+
+// Reserve count indices and return the first
+inline uint64_t takeRandomIndices(CounterRandom& random, std::size_t count)
+{
+    const uint64_t first = random.next;
+    random.next += count;
+    return first;
+}
+
+inline philox::Block randomBlock(const CounterRandom& random, uint64_t index, uint32_t stream)
+{
+    return philox::block({(uint32_t)index, (uint32_t)(index >> 32), stream, 0}, (uint32_t)random.seed, (uint32_t)(random.seed >> 32));
+}
+
+// Blocks for indices [first, first + count) of a stream, word w of block i goes to words[w][i]
+inline void randomBlocks(const CounterRandom& random, uint64_t first, uint32_t stream, std::size_t count, uint32_t* const words[4])
+{
+    const uint32_t k0 = (uint32_t)random.seed, k1 = (uint32_t)(random.seed >> 32);
+    std::size_t i = 0;
+
+#if defined(__SSE2__)
+    for(; i + 4 <= count; i += 4)
+    {
+        const uint64_t index = first + i;
+        __m128i c[4] = {
+            _mm_add_epi32(_mm_set1_epi32((uint32_t)index), _mm_set_epi32(3, 2, 1, 0)),
+            _mm_set1_epi32((uint32_t)(index >> 32)),
+            _mm_set1_epi32(stream),
+            _mm_setzero_si128()};
+
+        // The four indices only share the high word when the low one doesn't wrap
+        if((uint32_t)index > UINT32_MAX - 3)
+            break;
+
+        philox::block4(c, k0, k1);
+        for(int w = 0; w < 4; w++)
+            _mm_storeu_si128((__m128i*)(words[w] + i), c[w]);
+    }
+#endif
+
+    for(; i < count; i++)
+    {
+        const philox::Block b = randomBlock(random, first + i, stream);
+        for(int w = 0; w < 4; w++)
+            words[w][i] = b[w];
+    }
+}
+
+// Top 24 bits to [0, 1)
+inline float randomUnit(uint32_t word)
+{
+    return (word >> 8) * (1.0f / 16777216.0f);
+}
+
+inline float randomRange(uint32_t word, float min, float max)
+{
+    return min + (max - min) * randomUnit(word);
+}
+
+// Integer in [min, max]
+inline int randomInt(uint32_t word, int min, int max)
+{
+    return min + (int)(((uint64_t)word * (uint32_t)(max - min + 1)) >> 32);
+}
+
+#endif
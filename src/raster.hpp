@@ -0,0 +1,131 @@
+#ifndef RASTER_HPP
+#define RASTER_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+// Software drawing into an RGBA buffer, for worlds that have no window. Colors are 0xRRGGBBAA
+// like everywhere else, pixels are R, G, B, A bytes like renderer::readPixels returns them.
+struct RasterImage
+{
+    int width = 0, height = 0;
+    std::vector<uint8_t> pixels;
+};
+
+inline void initRaster(RasterImage& image, int width, int height)
+{
+    image.width = width;
+    image.height = height;
+    image.pixels.assign((std::size_t)width * height * 4, 0);
+}
+
+// Opaque black, like renderer::clear
+inline void clearRaster(RasterImage& image)
+{
+    uint8_t* p = image.pixels.data();
+    for(std::size_t i = 0; i < image.pixels.size(); i += 4)
+    {
+        p[i] = p[i + 1] = p[i + 2] = 0;
+        p[i + 3] = 255;
+    }
+}
+
+inline void rasterColor(uint32_t color, uint8_t rgba[4])
+{
+    rgba[0] = (uint8_t)(color >> 24);
+    rgba[1] = (uint8_t)(color >> 16);
+    rgba[2] = (uint8_t)(color >> 8);
+    rgba[3] = (uint8_t)color;
+}
+
+// Clip a line to [min, max] on both axes (Liang-Barsky), false when nothing of it is left
+inline bool clipRasterLine(float& x0, float& y0, float& x1, float& y1, float maxX, float maxY)
+{
+    if(!std::isfinite(x0) || !std::isfinite(y0) || !std::isfinite(x1) || !std::isfinite(y1))
+        return false;
+
+    const float dx = x1 - x0, dy = y1 - y0;
+    const float p[4] = {-dx, dx, -dy, dy};
+    const float q[4] = {x0, maxX - x0, y0, maxY - y0};
+
+    float t0 = 0.0f, t1 = 1.0f;
+    for(int i = 0; i < 4; i++)
+    {
+        if(p[i] == 0.0f)
+        {
+            if(q[i] < 0.0f)
+                return false;
+            continue;
+        }
+
+        const float t = q[i] / p[i];
+        if(p[i] < 0.0f)
+            t0 = std::max(t0, t);
+        else
+            t1 = std::min(t1, t);
+    }
+
+    if(t0 > t1)
+        return false;
+
+    x1 = x0 + dx * t1;
+    y1 = y0 + dy * t1;
+    x0 += dx * t0;
+    y0 += dy * t0;
+    return true;
+}
+
+// Bresenham, the end points are truncated to whole pixels as the renderer does
+inline void drawRasterLine(RasterImage& image, float x0, float y0, float x1, float y1, uint32_t color)
+{
+    if(!clipRasterLine(x0, y0, x1, y1, image.width - 1, image.height - 1))
+        return;
+
+    uint8_t rgba[4];
+    rasterColor(color, rgba);
+
+    int x = (int)x0, y = (int)y0;
+    const int xEnd = (int)x1, yEnd = (int)y1;
+    const int dx = std::abs(xEnd - x), dy = -std::abs(yEnd - y);
+    const int sx = x < xEnd ? 1 : -1, sy = y < yEnd ? 1 : -1;
+    int error = dx + dy;
+
+    while(true)
+    {
+        std::memcpy(&image.pixels[((std::size_t)y * image.width + x) * 4], rgba, 4);
+        if(x == xEnd && y == yEnd)
+            break;
+
+        const int e2 = 2 * error;
+        if(e2 >= dy)
+        {
+            error += dy;
+            x += sx;
+        }
+        if(e2 <= dx)
+        {
+            error += dx;
+            y += sy;
+        }
+    }
+}
+
+inline void drawRasterPoints(RasterImage& image, const float* xs, const float* ys, std::size_t count, uint32_t color)
+{
+    uint8_t rgba[4];
+    rasterColor(color, rgba);
+
+    for(std::size_t i = 0; i < count; i++)
+    {
+        if(!(xs[i] >= 0.0f && xs[i] < image.width && ys[i] >= 0.0f && ys[i] < image.height))
+            continue;
+
+        std::memcpy(&image.pixels[((std::size_t)ys[i] * image.width + (std::size_t)xs[i]) * 4], rgba, 4);
+    }
+}
+
+#endif
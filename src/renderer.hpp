@@ -43,6 +43,21 @@ public:
         SDL_RenderDrawLine(_renderer, x0, y0, x1, y1);
     }
 
+    // Draw count points from an array of interleaved x,y floats in a single call
+    static void drawPoints(const float* points, int count, uint32_t color)
+    {
+        static_assert(sizeof(SDL_FPoint) == 2 * sizeof(float), "SDL_FPoint must be two packed floats");
+
+        SDL_SetRenderDrawColor(_renderer, (uint8_t)(color >> 24), (uint8_t)(color >> 16), (uint8_t)(color >> 8), (uint8_t)(color));
+        SDL_RenderDrawPointsF(_renderer, reinterpret_cast<const SDL_FPoint*>(points), count);
+    }
+
+    // What was drawn since clear as RGBA bytes, call before show
+    static bool readPixels(void* pixels, int pitch)
+    {
+        return SDL_RenderReadPixels(_renderer, nullptr, SDL_PIXELFORMAT_RGBA32, pixels, pitch) == 0;
+    }
+
     static void show()
     {
         SDL_RenderPresent(_renderer);
@@ -0,0 +1,330 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iterator>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+
+#include "bytes.hpp"
+#include "parse.hpp"
+
+// Scenes describe what to spawn and when, as a list of waves.
+//
+// Text format, one wave per line, '#' starts a comment:
+//
+//     wave time=0 archetype=astroid count=100 scale=2.5:10 speed=50:150 rotation=-3:3 placement=edge color=FFFFFFFF
+//
+// Every key is optional. Ranges are written min:max and sampled uniformly, a single value
+// means min == max. Placement is 'edge' (on the top or left window edge) or 'uniform' (anywhere).
+// Archetypes are 'astroid', 'ship', 'saucer' and 'homing' (astroids that steer towards the ship).
+//
+// The compiled binary format is the magic "ASCN", a version, the wave count and then one
+// fixed size record per wave. It is what the game should load, the text is for authoring.
+
+enum class SceneArchetype : uint8_t
+{
+    ASTROID = 0,
+    SHIP = 1,
+    SAUCER = 2,
+    HOMING_ASTROID = 3
+};
+
+enum class ScenePlacement : uint8_t
+{
+    EDGE = 0,
+    UNIFORM = 1
+};
+
+struct SpawnDistribution
+{
+    float scaleMin, scaleMax;
+    float speedMin, speedMax;
+    float rotationMin, rotationMax;
+    ScenePlacement placement;
+    uint32_t color;
+};
+
+struct SceneWave
+{
+    float time;     // Seconds after the scene started
+    SceneArchetype archetype;
+    uint32_t count;
+    SpawnDistribution distribution;
+};
+
+struct Scene
+{
+    std::vector<SceneWave> waves;   // Sorted by time
+};
+
+constexpr uint32_t sceneMagic = 'A' | ('S' << 8) | ('C' << 16) | ('N' << 24);
+constexpr uint32_t sceneVersion = 1;
+
+inline SceneWave defaultSceneWave()
+{
+    return {0.0f, SceneArchetype::ASTROID, 1, {2.5f, 2.5f, 50.0f, 150.0f, -3.0f, 3.0f, ScenePlacement::EDGE, 0xFFFFFFFF}};
+}
+
+inline bool parseSceneRange(const std::string& value, float& min, float& max)
+{
+    char* end;
+    min = std::strtof(value.c_str(), &end);
+    if(end == value.c_str())
+        return false;
+
+    max = min;
+    if(*end == ':')
+    {
+        const char* second = end + 1;
+        max = std::strtof(second, &end);
+        if(end == second)
+            return false;
+    }
+
+    return *end == '\0' && min <= max;
+}
+
+// Waves above this are surely a typo, and would try to stream in more entities than fit in memory
+constexpr uint32_t maxWaveCount = 1 << 24;
+
+// Exactly eight hex digits, RRGGBBAA
+inline bool parseSceneColor(const std::string& value, uint32_t& color)
+{
+    if(value.size() != 8 || !std::all_of(value.begin(), value.end(), [](char c) { return std::isxdigit((unsigned char)c); }))
+        return false;
+
+    color = std::strtoul(value.c_str(), nullptr, 16);
+    return true;
+}
+
+inline bool parseSceneKey(const std::string& key, const std::string& value, SceneWave& wave)
+{
+    auto& dist = wave.distribution;
+
+    if(key == "time")
+    {
+        float max;
+        return parseSceneRange(value, wave.time, max) && wave.time == max && wave.time >= 0.0f;
+    }
+    if(key == "count")
+        return parseCount(value.c_str(), wave.count, maxWaveCount);
+    if(key == "scale")
+        return parseSceneRange(value, dist.scaleMin, dist.scaleMax);
+    if(key == "speed")
+        return parseSceneRange(value, dist.speedMin, dist.speedMax);
+    if(key == "rotation")
+        return parseSceneRange(value, dist.rotationMin, dist.rotationMax);
+    if(key == "color")
+        return parseSceneColor(value, dist.color);
+    if(key == "archetype")
+    {
+        if(value == "astroid")
+            wave.archetype = SceneArchetype::ASTROID;
+        else if(value == "ship")
+            wave.archetype = SceneArchetype::SHIP;
+        else if(value == "saucer")
+            wave.archetype = SceneArchetype::SAUCER;
+        else if(value == "homing")
+            wave.archetype = SceneArchetype::HOMING_ASTROID;
+        else
+            return false;
+        return true;
+    }
+    if(key == "placement")
+    {
+        if(value == "edge")
+            dist.placement = ScenePlacement::EDGE;
+        else if(value == "uniform")
+            dist.placement = ScenePlacement::UNIFORM;
+        else
+            return false;
+        return true;
+    }
+
+    return false;
+}
+
+inline bool validSceneRange(float min, float max)
+{
+    return std::isfinite(min) && std::isfinite(max) && min <= max;
+}
+
+// The checks every wave has to pass, whichever format it came from. NaN fails every comparison,
+// so it is rejected here too and can't reach the sort.
+inline bool validSceneWave(const SceneWave& wave)
+{
+    auto& dist = wave.distribution;
+
+    return std::isfinite(wave.time) && wave.time >= 0.0f &&
+        wave.count > 0 && wave.count <= maxWaveCount &&
+        wave.archetype <= SceneArchetype::HOMING_ASTROID &&
+        dist.placement <= ScenePlacement::UNIFORM &&
+        validSceneRange(dist.scaleMin, dist.scaleMax) &&
+        validSceneRange(dist.speedMin, dist.speedMax) &&
+        validSceneRange(dist.rotationMin, dist.rotationMax);
+}
+
+// scene is only replaced when the whole text parses
+bool parseSceneText(std::istream& in, Scene& scene)
+{
+    Scene parsed;
+
+    std::string line;
+    for(int lineNumber = 1; std::getline(in, line); lineNumber++)
+    {
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream tokens(line);
+        std::string token;
+        if(!(tokens >> token))
+            continue;
+
+        if(token != "wave")
+        {
+            std::cerr << "Scene line " << lineNumber << ": expected 'wave', got '" << token << "'" << std::endl;
+            return false;
+        }
+
+        SceneWave wave = defaultSceneWave();
+        while(tokens >> token)
+        {
+            auto split = token.find('=');
+            if(split == std::string::npos || !parseSceneKey(token.substr(0, split), token.substr(split + 1), wave))
+            {
+                std::cerr << "Scene line " << lineNumber << ": bad value '" << token << "'" << std::endl;
+                return false;
+            }
+        }
+
+        if(!validSceneWave(wave))
+        {
+            std::cerr << "Scene line " << lineNumber << ": invalid wave" << std::endl;
+            return false;
+        }
+
+        parsed.waves.push_back(wave);
+    }
+
+    std::stable_sort(parsed.waves.begin(), parsed.waves.end(),
+            [](const SceneWave& a, const SceneWave& b) { return a.time < b.time; });
+
+    std::swap(scene, parsed);
+    return true;
+}
+
+void writeSceneBinary(const Scene& scene, std::vector<uint8_t>& bytes)
+{
+    bytes.clear();
+    ByteWriter w{bytes};
+
+    w.u32(sceneMagic);
+    w.u32(sceneVersion);
+    w.u32(scene.waves.size());
+
+    for(auto& wave : scene.waves)
+    {
+        auto& dist = wave.distribution;
+
+        w.f32(wave.time);
+        w.u8((uint8_t)wave.archetype);
+        w.u8((uint8_t)dist.placement);
+        w.u16(0);
+        w.u32(wave.count);
+        w.f32(dist.scaleMin);
+        w.f32(dist.scaleMax);
+        w.f32(dist.speedMin);
+        w.f32(dist.speedMax);
+        w.f32(dist.rotationMin);
+        w.f32(dist.rotationMax);
+        w.u32(dist.color);
+    }
+}
+
+// scene is only replaced when every record is valid
+bool readSceneBinary(const uint8_t* data, std::size_t size, Scene& scene)
+{
+    constexpr std::size_t waveSize = 40;
+
+    ByteReader r{data, size, 0, false};
+
+    if(r.u32() != sceneMagic || r.u32() != sceneVersion)
+        return false;
+
+    uint32_t waveCount = r.u32();
+    if(r.failed || waveCount > (size - r.pos) / waveSize)
+        return false;
+
+    Scene decoded;
+    decoded.waves.resize(waveCount);
+    for(auto& wave : decoded.waves)
+    {
+        auto& dist = wave.distribution;
+
+        wave.time = r.f32();
+        wave.archetype = (SceneArchetype)r.u8();
+        dist.placement = (ScenePlacement)r.u8();
+        r.u16();
+        wave.count = r.u32();
+        dist.scaleMin = r.f32();
+        dist.scaleMax = r.f32();
+        dist.speedMin = r.f32();
+        dist.speedMax = r.f32();
+        dist.rotationMin = r.f32();
+        dist.rotationMax = r.f32();
+        dist.color = r.u32();
+
+        if(r.failed || !validSceneWave(wave))
+            return false;
+    }
+
+    std::stable_sort(decoded.waves.begin(), decoded.waves.end(),
+            [](const SceneWave& a, const SceneWave& b) { return a.time < b.time; });
+
+    std::swap(scene, decoded);
+    return true;
+}
+
+// Load a compiled scene, falling back to the text format when the magic doesn't match
+bool loadScene(const char* path, Scene& scene)
+{
+    std::ifstream file(path, std::ios::binary);
+    if(!file)
+    {
+        std::cerr << "Could not open scene " << path << std::endl;
+        return false;
+    }
+
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    ByteReader r{bytes.data(), bytes.size(), 0, false};
+    if(r.u32() == sceneMagic)
+        return readSceneBinary(bytes.data(), bytes.size(), scene);
+
+    std::istringstream text(std::string(bytes.begin(), bytes.end()));
+    return parseSceneText(text, scene);
+}
+
+bool compileScene(const char* textPath, const char* binaryPath)
+{
+    Scene scene;
+    if(!loadScene(textPath, scene))
+        return false;
+
+    std::vector<uint8_t> bytes;
+    writeSceneBinary(scene, bytes);
+
+    std::ofstream file(binaryPath, std::ios::binary);
+    file.write((const char*)bytes.data(), bytes.size());
+    return (bool)file;
+}
+
+#endif
@@ -0,0 +1,370 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+#include "bytes.hpp"
+
+// World state snapshots for streaming to clients.
+//
+// Every entity is quantized to a few bytes and a snapshot is encoded as a delta against a
+// baseline the client has acknowledged: entities that are unchanged are left out, changed
+// entities only carry the fields that differ and entities missing from the snapshot are
+// listed as removed. Both sides keep the quantized values so the delta never drifts.
+
+// Quantized state of one entity
+struct NetEntity
+{
+    uint32_t id;
+    uint16_t x, y;          // Position in 1/8 pixels
+    int16_t xVel, yVel;     // Velocity in 1/16 pixels per second
+    uint16_t dir;           // Angle in 1/65536 turns
+    uint8_t shape;
+    uint8_t scale;          // Scale in 1/16 units
+    uint32_t color;
+};
+
+struct Snapshot
+{
+    uint32_t tick;
+    std::vector<NetEntity> entities;    // Sorted by id
+};
+
+constexpr float netPosScale = 8.0f;
+constexpr float netVelScale = 16.0f;
+constexpr float netScaleScale = 16.0f;
+constexpr float netDirScale = 65536.0f / (2.0f * 3.14159265358979323846f);
+
+inline uint16_t quantizePos(float v)
+{
+    return (uint16_t)std::min(std::max(v * netPosScale + 0.5f, 0.0f), 65535.0f);
+}
+
+inline int16_t quantizeVel(float v)
+{
+    return (int16_t)std::min(std::max(std::nearbyint(v * netVelScale), -32767.0f), 32767.0f);
+}
+
+inline uint16_t quantizeDir(float v)
+{
+    return (uint16_t)(int32_t)std::nearbyint(v * netDirScale);
+}
+
+inline uint8_t quantizeScale(float v)
+{
+    return (uint8_t)std::min(std::max(v * netScaleScale + 0.5f, 0.0f), 255.0f);
+}
+
+inline float dequantizePos(uint16_t v) { return v / netPosScale; }
+inline float dequantizeVel(int16_t v) { return v / netVelScale; }
+inline float dequantizeDir(uint16_t v) { return (int16_t)v / netDirScale; }
+inline float dequantizeScale(uint8_t v) { return v / netScaleScale; }
+
+
+// Delta encoding
+enum NetField : uint8_t
+{
+    NET_POS = 1 << 0,
+    NET_VEL = 1 << 1,
+    NET_DIR = 1 << 2,
+    NET_SHAPE = 1 << 3,
+    NET_SCALE = 1 << 4,
+    NET_COLOR = 1 << 5,
+    NET_ALL = 0x3F
+};
+
+inline uint8_t diffNetEntity(const NetEntity& a, const NetEntity& b)
+{
+    uint8_t mask = 0;
+    if(a.x != b.x || a.y != b.y) mask |= NET_POS;
+    if(a.xVel != b.xVel || a.yVel != b.yVel) mask |= NET_VEL;
+    if(a.dir != b.dir) mask |= NET_DIR;
+    if(a.shape != b.shape) mask |= NET_SHAPE;
+    if(a.scale != b.scale) mask |= NET_SCALE;
+    if(a.color != b.color) mask |= NET_COLOR;
+    return mask;
+}
+
+// Write the fields in mask relative to base, new entities use a zeroed base
+inline void writeNetEntity(ByteWriter& w, const NetEntity& e, const NetEntity& base, uint8_t mask)
+{
+    if(mask & NET_POS)
+    {
+        w.svarint((int32_t)e.x - base.x);
+        w.svarint((int32_t)e.y - base.y);
+    }
+    if(mask & NET_VEL)
+    {
+        w.svarint((int32_t)e.xVel - base.xVel);
+        w.svarint((int32_t)e.yVel - base.yVel);
+    }
+    if(mask & NET_DIR)
+        w.svarint((int16_t)(uint16_t)(e.dir - base.dir));
+    if(mask & NET_SHAPE)
+        w.u8(e.shape);
+    if(mask & NET_SCALE)
+        w.u8(e.scale);
+    if(mask & NET_COLOR)
+        w.u32(e.color);
+}
+
+inline void readNetEntity(ByteReader& r, NetEntity& e, uint8_t mask)
+{
+    if(mask & NET_POS)
+    {
+        e.x += r.svarint();
+        e.y += r.svarint();
+    }
+    if(mask & NET_VEL)
+    {
+        e.xVel += r.svarint();
+        e.yVel += r.svarint();
+    }
+    if(mask & NET_DIR)
+        e.dir += r.svarint();
+    if(mask & NET_SHAPE)
+        e.shape = r.u8();
+    if(mask & NET_SCALE)
+        e.scale = r.u8();
+    if(mask & NET_COLOR)
+        e.color = r.u32();
+}
+
+// Encode current against baseline, a null baseline encodes a full snapshot.
+//
+// Layout: tick, baseline tick (0 for none), removed ids, then changed entities as
+// (id delta, field mask, fields). Ids are delta coded against the previous id in the list.
+void encodeSnapshot(const Snapshot& current, const Snapshot* baseline, std::vector<uint8_t>& bytes)
+{
+    static const std::vector<NetEntity> empty;
+    const std::vector<NetEntity>& base = baseline ? baseline->entities : empty;
+    const std::vector<NetEntity>& cur = current.entities;
+
+    bytes.clear();
+    ByteWriter w{bytes};
+
+    w.u32(current.tick);
+    w.u32(baseline ? baseline->tick : 0);
+
+    // Removed: in the baseline but not in the current snapshot
+    std::vector<uint32_t> removed;
+    std::size_t i = 0, j = 0;
+    while(i < base.size())
+    {
+        if(j < cur.size() && cur[j].id < base[i].id)
+            j++;
+        else if(j < cur.size() && cur[j].id == base[i].id)
+            i++, j++;
+        else
+            removed.push_back(base[i++].id);
+    }
+
+    w.varint(removed.size());
+    uint32_t lastId = 0;
+    for(auto id : removed)
+    {
+        w.varint(id - lastId);
+        lastId = id;
+    }
+
+    // Changed or new entities. The count is patched in afterwards so we only walk once.
+    const std::size_t countPos = bytes.size();
+    w.u32(0);
+
+    static const NetEntity zero = {};
+    uint32_t changed = 0;
+    lastId = 0;
+    i = 0;
+
+    for(auto& e : cur)
+    {
+        while(i < base.size() && base[i].id < e.id)
+            i++;
+
+        const bool isNew = i >= base.size() || base[i].id != e.id;
+        const NetEntity& b = isNew ? zero : base[i];
+        const uint8_t mask = isNew ? NET_ALL : diffNetEntity(e, b);
+
+        if(mask == 0)
+            continue;
+
+        w.varint(e.id - lastId);
+        w.u8(mask);
+        writeNetEntity(w, e, b, mask);
+
+        lastId = e.id;
+        changed++;
+    }
+
+    bytes[countPos] = changed & 0xFF;
+    bytes[countPos+1] = (changed >> 8) & 0xFF;
+    bytes[countPos+2] = (changed >> 16) & 0xFF;
+    bytes[countPos+3] = changed >> 24;
+}
+
+// Peek at the baseline tick so the receiver can look it up before decoding
+inline uint32_t snapshotBaselineTick(const uint8_t* data, std::size_t size)
+{
+    ByteReader r{data, size, 4, false};
+    return r.u32();
+}
+
+// Decode a message produced by encodeSnapshot. baseline must be the snapshot whose tick
+// snapshotBaselineTick returned, or null if that was 0. Returns false on malformed input.
+bool decodeSnapshot(const uint8_t* data, std::size_t size, const Snapshot* baseline, Snapshot& out)
+{
+    ByteReader r{data, size, 0, false};
+
+    out.tick = r.u32();
+    uint32_t baselineTick = r.u32();
+
+    if((baselineTick != 0) != (baseline != nullptr) || (baseline && baseline->tick != baselineTick))
+        return false;
+
+    uint32_t removedCount = r.varint();
+    if(r.failed || removedCount > size)
+        return false;
+
+    std::vector<uint32_t> removed(removedCount);
+    uint32_t lastId = 0;
+    for(auto& id : removed)
+    {
+        lastId += r.varint();
+        id = lastId;
+    }
+
+    uint32_t changedCount = r.u32();
+    if(r.failed || changedCount > size)
+        return false;
+
+    // Merge the baseline (minus removed) with the changed list, both sorted by id
+    out.entities.clear();
+    if(baseline)
+        out.entities.reserve(baseline->entities.size() + changedCount);
+
+    std::size_t bi = 0, ri = 0;
+    auto copyBaselineUpTo = [&](uint64_t id)
+    {
+        while(baseline && bi < baseline->entities.size() && baseline->entities[bi].id < id)
+        {
+            const NetEntity& b = baseline->entities[bi++];
+            while(ri < removed.size() && removed[ri] < b.id)
+                ri++;
+            if(ri < removed.size() && removed[ri] == b.id)
+                continue;
+            out.entities.push_back(b);
+        }
+    };
+
+    lastId = 0;
+    for(uint32_t c = 0; c < changedCount; c++)
+    {
+        uint32_t id = lastId + r.varint();
+        uint8_t mask = r.u8();
+        lastId = id;
+
+        copyBaselineUpTo(id);
+
+        NetEntity e = {};
+        if(baseline && bi < baseline->entities.size() && baseline->entities[bi].id == id)
+            e = baseline->entities[bi++];
+
+        e.id = id;
+        readNetEntity(r, e, mask);
+        out.entities.push_back(e);
+
+        if(r.failed)
+            return false;
+    }
+
+    copyBaselineUpTo((uint64_t)UINT32_MAX + 1);
+
+    return !r.failed;
+}
+
+
+// Messages larger than one datagram are split into fragments that are reassembled on the
+// receiving side. A message is only usable once every fragment of it has arrived.
+constexpr uint8_t netSnapshotPacket = 'S';
+constexpr uint8_t netAckPacket = 'A';
+constexpr std::size_t netFragmentSize = 1200;
+constexpr std::size_t netFragmentHeaderSize = 9;
+
+// Call send(data, size) once per fragment
+template<typename SendFunc>
+void sendFragmented(const std::vector<uint8_t>& message, uint32_t tick, SendFunc&& send)
+{
+    const std::size_t fragmentCount = std::max<std::size_t>(1, (message.size() + netFragmentSize - 1) / netFragmentSize);
+
+    uint8_t packet[netFragmentHeaderSize + netFragmentSize];
+    for(std::size_t f = 0; f < fragmentCount; f++)
+    {
+        std::size_t from = f * netFragmentSize;
+        std::size_t size = std::min(netFragmentSize, message.size() - from);
+
+        packet[0] = netSnapshotPacket;
+        packet[1] = tick & 0xFF;
+        packet[2] = (tick >> 8) & 0xFF;
+        packet[3] = (tick >> 16) & 0xFF;
+        packet[4] = tick >> 24;
+        packet[5] = f & 0xFF;
+        packet[6] = f >> 8;
+        packet[7] = fragmentCount & 0xFF;
+        packet[8] = fragmentCount >> 8;
+        std::copy(message.begin() + from, message.begin() + from + size, packet + netFragmentHeaderSize);
+
+        send(packet, netFragmentHeaderSize + size);
+    }
+}
+
+struct FragmentAssembler
+{
+    uint32_t tick;
+    std::size_t received;
+    std::vector<std::vector<uint8_t>> fragments;
+    std::vector<uint8_t> message;
+};
+
+// Feed one snapshot packet. Returns true when it completed a message newer than the last
+// completed one, which is then available in assembler.message.
+bool addFragment(FragmentAssembler& assembler, const uint8_t* packet, std::size_t size)
+{
+    if(size < netFragmentHeaderSize || packet[0] != netSnapshotPacket)
+        return false;
+
+    ByteReader r{packet, size, 1, false};
+    uint32_t tick = r.u32();
+    uint16_t index = r.u16();
+    uint16_t count = r.u16();
+
+    if(count == 0 || index >= count || tick < assembler.tick)
+        return false;
+
+    // Start over whenever a newer tick shows up, older partial messages are useless
+    if(tick > assembler.tick || assembler.fragments.size() != count)
+    {
+        assembler.tick = tick;
+        assembler.received = 0;
+        assembler.fragments.assign(count, {});
+    }
+
+    auto& fragment = assembler.fragments[index];
+    if(!fragment.empty() || assembler.received == count)
+        return false;
+
+    fragment.assign(packet + netFragmentHeaderSize, packet + size);
+    if(++assembler.received < count)
+        return false;
+
+    assembler.message.clear();
+    for(auto& f : assembler.fragments)
+        assembler.message.insert(assembler.message.end(), f.begin(), f.end());
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef TEXT_HPP
+#define TEXT_HPP
+
+#include <array>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cctype>
+
+// Vector font text.
+//
+// Every glyph is a single stroke (a polyline) on a 4x6 grid with y pointing down. The tables are
+// turned into one flat vertex array at compile time. Strings are laid out once into text runs
+// and only laid out again when their text or size changes, so a label that stays the same only
+// costs a copy of its vertices per frame.
+
+namespace glyphs
+{
+    constexpr int8_t END = -1;
+
+    // Letters A-Z followed by the digits 0-9
+    constexpr int8_t strokes[] = {
+    0,6,0,2,2,0,4,2,4,4,0,4,4,4,4,6, END, // A
+    0,3,0,6,2,6,3,5,3,4,2,3,0,3,0,0,2,0,3,1,3,2,2,3, END, // B
+    4,0,0,0,0,6,4,6, END, // C
+    0,0,0,6,2,6,4,4,4,2,2,0,0,0, END, // D
+    4,0,0,0,0,3,3,3,0,3,0,6,4,6, END, // E
+    4,0,0,0,0,3,3,3,0,3,0,6, END, // F
+    4,2,4,0,0,0,0,6,4,6,4,4,2,4, END, // G
+    0,0,0,6,0,3,4,3,4,0,4,6, END, // H
+    0,0,4,0,2,0,2,6,4,6,0,6, END, // I
+    4,0,4,6,2,6,0,4, END, // J
+    3,0,0,3,0,0,0,6,0,3,3,6, END, // K
+    0,0,0,6,4,6, END, // L
+    0,6,0,0,2,2,4,0,4,6, END, // M
+    0,6,0,0,4,6,4,0, END, // N
+    0,0,4,0,4,6,0,6,0,0, END, // O
+    0,6,0,0,4,0,4,3,0,3, END, // P
+    0,0,0,6,2,6,3,5,4,6,2,4,3,5,4,4,4,0,0,0, END, // Q
+    0,6,0,0,4,0,4,3,0,3,1,3,4,6, END, // R
+    4,0,0,0,0,3,4,3,4,6,0,6, END, // S
+    0,0,4,0,2,0,2,6, END, // T
+    0,0,0,6,4,6,4,0, END, // U
+    0,0,2,6,4,0, END, // V
+    0,0,0,6,2,4,4,6,4,0, END, // W
+    0,0,4,6,2,3,4,0,0,6, END, // X
+    0,0,2,2,4,0,2,2,2,6, END, // Y
+    0,0,4,0,0,6,4,6, END, // Z
+    0,0,0,6,4,6,4,0,0,0, END, // 0
+    2,0,2,6, END, // 1
+    0,0,4,0,4,3,0,3,0,6,4,6, END, // 2
+    0,0,4,0,4,3,0,3,4,3,4,6,0,6, END, // 3
+    0,0,0,3,4,3,4,0,4,6, END, // 4
+    4,0,0,0,0,3,4,3,4,6,0,6, END, // 5
+    0,0,0,6,4,6,4,3,0,3, END, // 6
+    0,0,4,0,4,6, END, // 7
+    0,3,4,3,4,6,0,6,0,0,4,0,4,3, END, // 8
+    4,3,0,3,0,0,4,0,4,6, END, // 9
+    };
+
+    constexpr std::size_t glyphCount = 36;
+    constexpr float width = 4.0f;
+    constexpr float height = 6.0f;
+    constexpr float advance = 6.0f;
+
+    constexpr std::size_t countVertexFloats()
+    {
+        std::size_t count = 0;
+        for(auto v : strokes)
+            if(v != END)
+                count++;
+        return count;
+    }
+
+    constexpr std::size_t vertexFloatCount = countVertexFloats();
+
+    struct Range
+    {
+        uint16_t fromI, toI;
+    };
+
+    // Vertex data of all glyphs, as interleaved x,y floats
+    constexpr std::array<float, vertexFloatCount> makeVertices()
+    {
+        std::array<float, vertexFloatCount> vertices = {};
+        std::size_t i = 0;
+        for(auto v : strokes)
+            if(v != END)
+                vertices[i++] = v;
+        return vertices;
+    }
+
+    // Where each glyph lives in vertices
+    constexpr std::array<Range, glyphCount> makeRanges()
+    {
+        std::array<Range, glyphCount> ranges = {};
+        std::size_t glyph = 0, i = 0, from = 0;
+        for(auto v : strokes)
+        {
+            if(v == END)
+            {
+                ranges[glyph++] = {(uint16_t)from, (uint16_t)i};
+                from = i;
+            }
+            else
+                i++;
+        }
+        return ranges;
+    }
+
+    constexpr std::array<float, vertexFloatCount> vertices = makeVertices();
+    constexpr std::array<Range, glyphCount> ranges = makeRanges();
+
+    static_assert(ranges[glyphCount-1].toI == vertexFloatCount, "Every glyph needs an END marker");
+
+    // Glyph index of a character, or -1 for characters without a glyph which only advance
+    constexpr int glyphIndex(char c)
+    {
+        if(c >= 'a' && c <= 'z')
+            return c - 'a';
+        if(c >= 'A' && c <= 'Z')
+            return c - 'A';
+        if(c >= '0' && c <= '9')
+            return 26 + (c - '0');
+        return -1;
+    }
+}
+
+// A laid out string. Vertices are in pixels relative to the top left corner of the text and
+// strokeEnds holds the end index in vertices of every stroke.
+struct TextRun
+{
+    std::string text;
+    float size;
+    std::vector<float> vertices;
+    std::vector<uint32_t> strokeEnds;
+};
+
+struct TextLabel
+{
+    TextRun run;
+    float x, y;
+    uint32_t color;
+    bool visible;
+};
+
+// All labels that are drawn together, addressed by slot
+struct TextBatch
+{
+    std::vector<TextLabel> labels;
+};
+
+// size is the height of a glyph in pixels
+void layoutText(TextRun& run, const char* text, float size)
+{
+    const float scale = size / glyphs::height;
+
+    run.text = text;
+    run.size = size;
+    run.vertices.clear();
+    run.strokeEnds.clear();
+
+    float penX = 0.0f;
+    for(const char* c = text; *c != '\0'; c++)
+    {
+        int glyph = glyphs::glyphIndex(*c);
+        if(glyph >= 0)
+        {
+            auto range = glyphs::ranges[glyph];
+            for(std::size_t i = range.fromI; i < range.toI; i += 2)
+            {
+                run.vertices.push_back(penX + glyphs::vertices[i] * scale);
+                run.vertices.push_back(glyphs::vertices[i+1] * scale);
+            }
+            run.strokeEnds.push_back(run.vertices.size());
+        }
+
+        penX += glyphs::advance * scale;
+    }
+}
+
+// Set the label in slot, the text is only laid out again when it or the size changed
+void setLabel(TextBatch& batch, std::size_t slot, const char* text, float x, float y, float size, uint32_t color)
+{
+    if(slot >= batch.labels.size())
+        batch.labels.resize(slot + 1);
+
+    TextLabel& label = batch.labels[slot];
+    if(label.run.size != size || label.run.text != text)
+        layoutText(label.run, text, size);
+
+    label.x = x;
+    label.y = y;
+    label.color = color;
+    label.visible = true;
+}
+
+#endif